@@ -32,7 +32,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * Description
  *
  * This application will take a Raw file captured using Raspistill
- * or similar, and analyse it in order to produce a customised lens shading
+ * or similar, or a DNG from libcamera, and analyse it in order to produce a customised lens shading
  * table. In order to get sensible results, the image should be of a
  * plain, uniformly illuminated scene (eg a nice white wall).
  *
@@ -74,6 +74,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <sys/mman.h>
@@ -81,11 +82,133 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
 
 #define NUM_CHANNELS 4
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+//GCC's generic vector extensions, used where the auto-vectoriser can't cope
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 9
+#define HAVE_VECTOR_EXT
+typedef uint8_t v8u8 __attribute__((vector_size(8)));
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+#endif
+
+//Default deviation from the same colour neighbours, in percent, for a pixel
+//to be treated as defective when the defect map is requested.
+#define DEFECT_THRESHOLD_DEFAULT 50
+
+enum fit_model_t {
+	FIT_NONE,
+	FIT_RADIAL,
+	FIT_SPLINE
+};
+
+//Fixed point format of the gains in the tables, as integer and fractional
+//bits. The firmware takes 3.5, in bytes. Wider formats are written as 16 bit.
+struct gain_format {
+	int int_bits;
+	int frac_bits;
+};
+
+//Cells whose gains were limited to the range of the gain format
+struct gain_clamps {
+	unsigned int clipped;	//At the largest gain
+	unsigned int floored;	//At unity, being above the reference level
+};
+
+//Level of each channel that its gains bring the grid cells up to
+enum norm_mode_t {
+	NORM_MAX,		//The brightest cell
+	NORM_PERCENTILE,	//A percentile of the cells, so outliers are ignored
+	NORM_CENTRE,		//The mean of the cells at the centre of the grid
+	NORM_FIXED		//A given pixel level above black
+};
+
+struct normalisation {
+	enum norm_mode_t mode;
+	double value;		//Percentile, or pixel level
+	int no_clip;		//Lower the level where needed so no gain clips
+};
+
+//First line of the block sums written with -o 64
+#define BLOCK_SUMS_ID "lens_shading_analyse block sums"
+
+#define TARGET_TRANSFORMS 4	//Every combination of horizontal and vertical flip
+#define SENSOR_MODES_MAX 8
+#define STREAM_WINDOW_MAX 1024
+#define SATURATION_MARGIN 64	//Pixels within 1/64 of the white level count as saturated
+#define EXPOSURE_LINE_PAIRS 64	//Sampled by the exposure check
+
+//File format of the channel planes written with -o 8
+enum plane_format_t {
+	PLANE_BIN,	//Headerless 16 bit little endian samples
+	PLANE_PGM,	//16 bit binary PGM
+	PLANE_TIFF,	//Uncompressed 16 bit greyscale TIFF
+	PLANE_LSC	//All four planes compressed into channels.lsc
+};
+//Room for the largest plane file header
+#define PLANE_HEADER_MAX 128
+//Largest preview downsampling factor that can't overflow the box sums
+#define PREVIEW_FACTOR_MAX 256
+#define TEXT_BUF_SIZE 65536
+
+//Compressed channel planes. The planes are coded in blocks of LSC_BLOCK_ROWS
+//rows, each of which can be decoded on its own.
+#define LSC_HEADER_SIZE 64
+#define LSC_BLOCK_ROWS 16
+//Longest Rice quotient before a sample is stored verbatim instead
+#define RICE_ESCAPE 24
+//Rice parameter marking a row stored packed, without prediction
+#define RICE_RAW_ROW 31
+
+//Upper limit on worker threads
+#define MAX_THREADS 16
+
+//Statistic representing the analysis window of each grid cell
+enum estimator_t {
+	EST_MEAN,
+	EST_MEDIAN,
+	EST_TRIMMED	//Mean of the values between the lower and upper quartiles
+};
+
+const char *estimator_names[] = { "mean", "median", "trimmed" };
+
+//How a dark frame given with -d is taken off the flat field
+enum dark_mode_t {
+	DARK_LEVEL,	//Its mean level, as a black level
+	DARK_CELL,	//Its statistics for each grid cell
+	DARK_PIXEL	//Pixel by pixel
+};
+
+//Most values in each list of settings to sweep over
+#define SWEEP_MAX 16
+
+//Terms of the radial model: 1, x, y, r^2, r^4, r^6
+#define RADIAL_TERMS 6
+//Maximum number of B-spline control points along each axis
+#define SPLINE_KNOTS_MAX 6
+#define FIT_TERMS_MAX (SPLINE_KNOTS_MAX*SPLINE_KNOTS_MAX)
+
 //This structure is at offset 0xB0 from the 'BRCM' ident.
 struct brcm_raw_header {
 	uint8_t name[32];
@@ -111,6 +234,29 @@ enum bayer_order_t {
 	GRBG
 };
 
+enum raw_packing_t {
+	PACKING_RAW10,		//MIPI CSI-2 packed, 4 pixels in 5 bytes
+	PACKING_RAW12,		//MIPI CSI-2 packed, 2 pixels in 3 bytes
+	PACKING_RAW16,		//Unpacked, 16 bits little endian
+	PACKING_RAW16_BE,	//Unpacked, 16 bits big endian
+	PACKING_PISP_COMP1	//Raspberry Pi 5 PiSP compressed, 8 pixels in 8 bytes
+};
+
+//Description of the Bayer data found in the input file
+struct raw_image {
+	const uint8_t *data;	//First line of Bayer data
+	size_t stride;
+	int width;
+	int height;
+	enum raw_packing_t packing;
+	int bayer_order;
+	uint16_t max_val;	//White level
+	unsigned int black_level;	//0 if not given by the file
+	uint16_t transform;
+	char model[32];
+	uint32_t exposure_us;	//0 if not given by the file
+};
+
 const int channel_ordering[4][4] = {
 	{ 0, 1, 2, 3 },
 	{ 2, 3, 0, 1 },
@@ -135,87 +281,4653 @@ uint8_t* sensor_model_check(int sensor_model, void* buffer, size_t size)
 		default:
 			return 0;
 			break;
-		}
-
-		if (memcmp(in_buf, "BRCM", 4) == 0)
-		{
-			return in_buf;
-		}
-		else
-		{
-			return 0;
-		}
-}
-
-uint16_t black_level_correct(uint16_t raw_pixel, unsigned int black_level, unsigned int max_value)
-{
-	return ((raw_pixel - black_level) * max_value) / (max_value - black_level);
-}
-
-void print_help(void)
-{
-	printf("\n");
-	printf("\n");
-	printf("\"lens_shading_analyse\" Lens shading analysis tool\n");
-	printf("\n");
-	printf("Analyzes the lens shading based on a raw image\n");
-	printf("\n");
-	printf("usage: lens_shading_analyse -i <filename> [options]\n");
-	printf("\n");
-	printf("Parameters\n");
-	printf("\n");
-	printf("-i  : Raw image file (mandatory)\n");
-	printf("-b  : Black level\n");
-	printf("-s  : Size of the analysis cell. Minimum 2, maximum 32, default 4\n");
-	printf("-o  : Output format. Formats can be output together, for example 3 = 1 + 2\n");
-	printf("      1  : Header file (default on)\n");
-	printf("      2  : Binary file\n");
-	printf("      4  : Text file\n");
-	printf("      8  : Channel data\n");
-	printf("\n");
-}
-
-int main(int argc, char *argv[])
-{
-	int in = 0;
-	FILE *out, *header, *table, *bin;
-	int i, x, y;
-	uint16_t *out_buf[NUM_CHANNELS];
-	uint16_t max_val;
-	void *mmap_buf;
-	uint8_t *in_buf;
-	struct stat sb;
-	int bits_per_sample;
-	int bayer_order;
-	struct brcm_raw_header *hdr;
-	int width, height, stride;
-	uint32_t grid_width, grid_height, block_px_max;
-	int single_channel_width, single_channel_height;
-	unsigned int black_level = 0;
-	uint32_t *block_sum;
-	uint8_t block_size = 4;
-	uint8_t out_frmt = 1;
-
-	if (argc < 2)
-	{
-		print_help();
-		return -1;
-	}
-
-	int nArg;
-	while ((nArg = getopt(argc, argv, "b:i:o:s:")) != -1)
-	{
-		switch (nArg) {
+		}
+
+		if (memcmp(in_buf, "BRCM", 4) == 0)
+		{
+			return in_buf;
+		}
+		else
+		{
+			return 0;
+		}
+}
+
+// Black level of the known sensors, or 0
+unsigned int sensor_black_level(const char *model)
+{
+	if (strncmp(model, "imx219", 6) == 0)
+		return 64;
+	else if (strncmp(model, "ov5647", 6) == 0)
+		return 16;
+	else if (strncmp(model, "testc", 6) == 0 ||
+			strncmp(model, "imx477", 6) == 0)
+		return 257;
+	return 0;
+}
+
+// Parse the BRCM header at in_buf, as written by raspistill --raw
+int parse_brcm_raw(const uint8_t *in_buf, size_t size, struct raw_image *img)
+{
+	const struct brcm_raw_header *hdr;
+	int bits_per_sample;
+
+	if (size < 32768 || memcmp(in_buf, "BRCM", 4))
+	{
+		printf("Raw file missing BRCM header\n");
+		return -1;
+	}
+
+	memcpy(img->model, &in_buf[16], 6);
+	img->model[6] = '\0';
+
+	hdr = (const struct brcm_raw_header*) (in_buf+0xB0);
+	printf("Header decoding: mode %s, width %u, height %u, padding %u %u\n",
+			hdr->name, hdr->width, hdr->height, hdr->padding_right, hdr->padding_down);
+	printf("transform %u, image format %u, bayer order %u, bayer format %u\n",
+			hdr->transform, hdr->format, hdr->bayer_order, hdr->bayer_format);
+	if (hdr->format != BRCM_FORMAT_BAYER ||
+			(hdr->bayer_format != BRCM_BAYER_RAW10 && hdr->bayer_format != BRCM_BAYER_RAW12))
+	{
+		printf("Raw file is not Bayer raw10 or raw12\n");
+		return -1;
+	}
+	bits_per_sample = hdr->bayer_format * 2 + 4;
+	img->packing = bits_per_sample == 10 ? PACKING_RAW10 : PACKING_RAW12;
+	img->bayer_order = hdr->bayer_order & 3;
+	img->max_val = ( 1 << bits_per_sample ) - 1;
+	img->black_level = 0;
+	img->width = hdr->width;
+	img->height = hdr->height;
+	img->transform = hdr->transform;
+	img->data = in_buf + 32768;
+
+	//Stride computed via same formula as the firmware uses.
+	img->stride = (((((img->width + hdr->padding_right)*(bits_per_sample == 10 ? 5 : 6))+3)>>2) + 31)&(~31);
+
+	if (32768 + img->stride*img->height > size)
+	{
+		printf("Raw file is too small for the image size\n");
+		return -1;
+	}
+	return 0;
+}
+
+//TIFF tags needed to find the CFA data in a DNG
+#define TIFF_NEW_SUBFILE_TYPE	254
+#define TIFF_IMAGE_WIDTH	256
+#define TIFF_IMAGE_LENGTH	257
+#define TIFF_BITS_PER_SAMPLE	258
+#define TIFF_COMPRESSION	259
+#define TIFF_PHOTOMETRIC	262
+#define TIFF_MODEL		272
+#define TIFF_EXIF_IFD		34665
+#define EXIF_EXPOSURE_TIME	33434
+#define TIFF_STRIP_OFFSETS	273
+#define TIFF_ORIENTATION	274
+#define TIFF_ROWS_PER_STRIP	278
+#define TIFF_STRIP_BYTE_COUNTS	279
+#define TIFF_SUB_IFDS		330
+#define TIFF_CFA_REPEAT_DIM	33421
+#define TIFF_CFA_PATTERN	33422
+#define DNG_UNIQUE_MODEL	50708
+#define DNG_BLACK_LEVEL		50714
+#define DNG_WHITE_LEVEL		50717
+#define DNG_ACTIVE_AREA		50829
+#define DNG_MASKED_AREAS	50830
+
+#define PHOTOMETRIC_CFA		32803
+#define DNG_MAX_IFDS		16
+
+struct tiff_file {
+	const uint8_t *buf;
+	size_t size;
+	int big_endian;
+};
+
+//The parts of an IFD we care about. Offsets of the tag entries are kept
+//for the array valued tags, and 0 if not present.
+struct dng_ifd {
+	uint32_t subfile_type;
+	uint32_t width, height;
+	uint32_t bits_per_sample;
+	uint32_t compression;
+	uint32_t photometric;
+	uint32_t rows_per_strip;
+	uint32_t orientation;
+	size_t strip_offsets, strip_byte_counts;
+	size_t cfa_repeat_dim, cfa_pattern;
+	size_t black_level, white_level;
+	size_t active_area, masked_areas;
+	size_t sub_ifds;
+};
+
+uint32_t tiff_get(const struct tiff_file *tiff, size_t offset, int bytes)
+{
+	uint32_t val = 0;
+	int i;
+
+	if (offset + bytes > tiff->size)
+		return 0;
+	for (i=0; i<bytes; i++)
+	{
+		int shift = tiff->big_endian ? (bytes-1-i)*8 : i*8;
+		val |= (uint32_t)tiff->buf[offset+i] << shift;
+	}
+	return val;
+}
+
+uint32_t tiff_count(const struct tiff_file *tiff, size_t entry)
+{
+	return entry ? tiff_get(tiff, entry+4, 4) : 0;
+}
+
+// Value number index of the IFD entry at offset entry, converted to double
+double tiff_value(const struct tiff_file *tiff, size_t entry, uint32_t index)
+{
+	static const int type_size[13] = { 0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8 };
+	uint32_t type = tiff_get(tiff, entry+2, 2);
+	uint32_t count = tiff_get(tiff, entry+4, 4);
+	size_t offset;
+
+	if (!entry || type >= 13 || !type_size[type] || index >= count)
+		return 0;
+	offset = (size_t)type_size[type] * count <= 4 ? entry+8 : tiff_get(tiff, entry+8, 4);
+	offset += (size_t)type_size[type] * index;
+
+	switch (type) {
+	case 3:		//SHORT
+		return tiff_get(tiff, offset, 2);
+	case 4:		//LONG
+		return tiff_get(tiff, offset, 4);
+	case 5:		//RATIONAL
+	{
+		uint32_t den = tiff_get(tiff, offset+4, 4);
+		return den ? (double)tiff_get(tiff, offset, 4) / den : 0;
+	}
+	case 8:		//SSHORT
+		return (int16_t)tiff_get(tiff, offset, 2);
+	case 9:		//SLONG
+		return (int32_t)tiff_get(tiff, offset, 4);
+	case 10:	//SRATIONAL
+	{
+		int32_t den = tiff_get(tiff, offset+4, 4);
+		return den ? (double)(int32_t)tiff_get(tiff, offset, 4) / den : 0;
+	}
+	default:	//BYTE, ASCII, UNDEFINED etc
+		return tiff_get(tiff, offset, type_size[type] == 1 ? 1 : 0);
+	}
+}
+
+// Read the tags we need from the IFD at offset. Returns the offset of the next IFD.
+uint32_t parse_tiff_ifd(const struct tiff_file *tiff, size_t offset, struct dng_ifd *ifd)
+{
+	uint32_t entries = tiff_get(tiff, offset, 2);
+	uint32_t i;
+
+	memset(ifd, 0, sizeof(*ifd));
+	ifd->compression = 1;
+	ifd->rows_per_strip = UINT32_MAX;
+	ifd->orientation = 1;
+	if (offset + 2 + entries*12 + 4 > tiff->size)
+		return 0;
+
+	for (i=0; i<entries; i++)
+	{
+		size_t entry = offset + 2 + i*12;
+
+		switch (tiff_get(tiff, entry, 2)) {
+		case TIFF_NEW_SUBFILE_TYPE:
+			ifd->subfile_type = tiff_value(tiff, entry, 0);
+			break;
+		case TIFF_IMAGE_WIDTH:
+			ifd->width = tiff_value(tiff, entry, 0);
+			break;
+		case TIFF_IMAGE_LENGTH:
+			ifd->height = tiff_value(tiff, entry, 0);
+			break;
+		case TIFF_BITS_PER_SAMPLE:
+			ifd->bits_per_sample = tiff_value(tiff, entry, 0);
+			break;
+		case TIFF_COMPRESSION:
+			ifd->compression = tiff_value(tiff, entry, 0);
+			break;
+		case TIFF_PHOTOMETRIC:
+			ifd->photometric = tiff_value(tiff, entry, 0);
+			break;
+		case TIFF_STRIP_OFFSETS:
+			ifd->strip_offsets = entry;
+			break;
+		case TIFF_ORIENTATION:
+			ifd->orientation = tiff_value(tiff, entry, 0);
+			break;
+		case TIFF_ROWS_PER_STRIP:
+			ifd->rows_per_strip = tiff_value(tiff, entry, 0);
+			break;
+		case TIFF_STRIP_BYTE_COUNTS:
+			ifd->strip_byte_counts = entry;
+			break;
+		case TIFF_SUB_IFDS:
+			ifd->sub_ifds = entry;
+			break;
+		case TIFF_CFA_REPEAT_DIM:
+			ifd->cfa_repeat_dim = entry;
+			break;
+		case TIFF_CFA_PATTERN:
+			ifd->cfa_pattern = entry;
+			break;
+		case DNG_BLACK_LEVEL:
+			ifd->black_level = entry;
+			break;
+		case DNG_WHITE_LEVEL:
+			ifd->white_level = entry;
+			break;
+		case DNG_ACTIVE_AREA:
+			ifd->active_area = entry;
+			break;
+		case DNG_MASKED_AREAS:
+			ifd->masked_areas = entry;
+			break;
+		}
+	}
+	return tiff_get(tiff, offset + 2 + entries*12, 4);
+}
+
+// Offset of the entry for tag in the IFD at offset, or 0 if there is none
+size_t tiff_find(const struct tiff_file *tiff, size_t offset, uint16_t tag)
+{
+	uint32_t entries = tiff_get(tiff, offset, 2);
+	uint32_t i;
+
+	for (i=0; i<entries; i++)
+	{
+		size_t entry = offset + 2 + i*12;
+		if (tiff_get(tiff, entry, 2) == tag)
+			return entry;
+	}
+	return 0;
+}
+
+// Copy an ASCII tag value from the IFD at offset, if present
+void tiff_get_string(const struct tiff_file *tiff, size_t offset, uint16_t tag, char *str, size_t len)
+{
+	size_t entry = tiff_find(tiff, offset, tag);
+	uint32_t j;
+
+	if (!entry)
+		return;
+	for (j=0; j<len-1 && j<tiff_count(tiff, entry); j++)
+		str[j] = tiff_value(tiff, entry, j);
+	str[j] = '\0';
+}
+
+static inline int min_int(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+static inline int max_int(int a, int b)
+{
+	return a > b ? a : b;
+}
+
+// Mean level of the optically masked areas of a DNG CFA image, or 0 if there
+// are none. Each area is given as top, left, bottom, right.
+unsigned int dng_masked_level(const struct tiff_file *tiff, size_t masked_areas, const struct raw_image *img)
+{
+	uint64_t sum = 0, count = 0;
+	uint32_t area;
+
+	for (area=0; area+4<=tiff_count(tiff, masked_areas); area+=4)
+	{
+		int top = tiff_value(tiff, masked_areas, area);
+		int left = tiff_value(tiff, masked_areas, area+1);
+		int bottom = min_int(tiff_value(tiff, masked_areas, area+2), img->height);
+		int right = min_int(tiff_value(tiff, masked_areas, area+3), img->width);
+		int x, y;
+
+		for (y=top; y<bottom; y++)
+		{
+			const uint8_t *line = img->data + (size_t)y*img->stride;
+			for (x=left; x<right; x++)
+				sum += tiff->big_endian ? (line[x*2] << 8) | line[x*2+1] : line[x*2] | (line[x*2+1] << 8);
+			count += right > left ? right - left : 0;
+		}
+	}
+	return count ? (sum + count/2) / count : 0;
+}
+
+// Find the uncompressed CFA image in a DNG file. Only the tags needed to
+// locate and describe the Bayer data are parsed, and the strips are used in
+// place in the mapped file.
+int parse_dng(const uint8_t *buf, size_t size, struct raw_image *img)
+{
+	struct tiff_file tiff = { buf, size, buf[0] == 'M' };
+	size_t ifds[DNG_MAX_IFDS];
+	int num_ifds = 0, i;
+	struct dng_ifd ifd;
+	uint32_t offset, strips, bytes_per_line;
+	int found = 0;
+
+	// Collect the top level IFDs and any SubIFDs from them
+	offset = tiff_get(&tiff, 4, 4);
+	memset(img->model, 0, sizeof(img->model));
+	tiff_get_string(&tiff, offset, DNG_UNIQUE_MODEL, img->model, sizeof(img->model));
+	tiff_get_string(&tiff, offset, TIFF_MODEL, img->model, sizeof(img->model));
+	{
+		//Exposure time in seconds, in IFD0 or its EXIF IFD
+		size_t exposure = tiff_find(&tiff, offset, EXIF_EXPOSURE_TIME);
+		size_t exif = tiff_find(&tiff, offset, TIFF_EXIF_IFD);
+		if (!exposure && exif)
+			exposure = tiff_find(&tiff, tiff_value(&tiff, exif, 0), EXIF_EXPOSURE_TIME);
+		img->exposure_us = tiff_value(&tiff, exposure, 0) * 1000000 + 0.5;
+	}
+	while (offset && num_ifds < DNG_MAX_IFDS)
+	{
+		ifds[num_ifds++] = offset;
+		offset = parse_tiff_ifd(&tiff, offset, &ifd);
+		for (i=0; i<tiff_count(&tiff, ifd.sub_ifds) && num_ifds < DNG_MAX_IFDS; i++)
+			ifds[num_ifds++] = tiff_value(&tiff, ifd.sub_ifds, i);
+	}
+
+	for (i=0; i<num_ifds; i++)
+	{
+		parse_tiff_ifd(&tiff, ifds[i], &ifd);
+		if (ifd.photometric == PHOTOMETRIC_CFA && ifd.subfile_type == 0)
+		{
+			found = 1;
+			break;
+		}
+	}
+	if (!found)
+	{
+		printf("No CFA image found in DNG\n");
+		return -1;
+	}
+
+	printf("DNG CFA image: width %u, height %u, %u bits per sample, compression %u\n",
+			ifd.width, ifd.height, ifd.bits_per_sample, ifd.compression);
+	if (ifd.compression != 1 || ifd.bits_per_sample != 16)
+	{
+		printf("Only uncompressed 16 bit DNG is supported\n");
+		return -1;
+	}
+	if (tiff_count(&tiff, ifd.cfa_pattern) != 4 ||
+			(ifd.cfa_repeat_dim && (tiff_value(&tiff, ifd.cfa_repeat_dim, 0) != 2 ||
+					tiff_value(&tiff, ifd.cfa_repeat_dim, 1) != 2)))
+	{
+		printf("DNG CFA pattern is not 2x2 Bayer\n");
+		return -1;
+	}
+
+	img->width = ifd.width;
+	img->height = ifd.height;
+	img->packing = tiff.big_endian ? PACKING_RAW16_BE : PACKING_RAW16;
+	img->transform = 0;
+
+	//CFA colours are 0 = red, 1 = green, 2 = blue
+	{
+		static const uint8_t patterns[4][4] = {
+			{ 0, 1, 1, 2 },	//RGGB
+			{ 1, 2, 0, 1 },	//GBRG
+			{ 2, 1, 1, 0 },	//BGGR
+			{ 1, 0, 2, 1 }	//GRBG
+		};
+		uint8_t cfa[4];
+		for (i=0; i<4; i++)
+			cfa[i] = tiff_value(&tiff, ifd.cfa_pattern, i);
+		for (i=0; i<4 && memcmp(cfa, patterns[i], 4); i++)
+			;
+		if (i == 4)
+		{
+			printf("Unsupported DNG CFA pattern %u %u %u %u\n", cfa[0], cfa[1], cfa[2], cfa[3]);
+			return -1;
+		}
+		img->bayer_order = i;
+	}
+
+	img->max_val = ifd.white_level ? tiff_value(&tiff, ifd.white_level, 0) : 65535;
+	img->black_level = 0;
+	if (tiff_count(&tiff, ifd.black_level))
+	{
+		//Average over the CFA if given per channel
+		double black = 0;
+		uint32_t count = tiff_count(&tiff, ifd.black_level);
+		for (i=0; i<count; i++)
+			black += tiff_value(&tiff, ifd.black_level, i);
+		img->black_level = black / count + 0.5;
+	}
+
+	//Orientation 2, 3 and 4 are flips, which map onto the transform bits
+	if (ifd.orientation == 2)
+		img->transform = 1;
+	else if (ifd.orientation == 3)
+		img->transform = 3;
+	else if (ifd.orientation == 4)
+		img->transform = 2;
+
+	//The strips must be contiguous to be used as one image
+	bytes_per_line = img->width * 2;
+	strips = tiff_count(&tiff, ifd.strip_offsets);
+	if (!strips || !ifd.rows_per_strip)
+	{
+		printf("DNG has no strips\n");
+		return -1;
+	}
+	offset = tiff_value(&tiff, ifd.strip_offsets, 0);
+	for (i=1; i<strips; i++)
+	{
+		if (tiff_value(&tiff, ifd.strip_offsets, i) != offset + (double)i*ifd.rows_per_strip*bytes_per_line)
+		{
+			printf("DNG strips are not contiguous\n");
+			return -1;
+		}
+	}
+	img->data = buf + offset;
+	img->stride = bytes_per_line;
+
+	if ((size_t)offset + img->stride*img->height > size)
+	{
+		printf("Raw file is too small for the image size\n");
+		return -1;
+	}
+
+	//Optical black pixels give a measured black level for this frame
+	if (tiff_count(&tiff, ifd.masked_areas) >= 4)
+	{
+		unsigned int masked_level = dng_masked_level(&tiff, ifd.masked_areas, img);
+		if (masked_level)
+		{
+			printf("Black level measured from the masked areas: %u (tagged %u)\n",
+					masked_level, img->black_level);
+			img->black_level = masked_level;
+		}
+	}
+
+	//Only analyse the active area, which excludes the masked pixels
+	if (tiff_count(&tiff, ifd.active_area) == 4)
+	{
+		uint32_t top = tiff_value(&tiff, ifd.active_area, 0);
+		uint32_t left = tiff_value(&tiff, ifd.active_area, 1);
+		uint32_t bottom = tiff_value(&tiff, ifd.active_area, 2);
+		uint32_t right = tiff_value(&tiff, ifd.active_area, 3);
+		//Bayer order after dropping an odd column, or an odd line
+		static const int hflip[4] = { GRBG, BGGR, GBRG, RGGB };
+		static const int vflip[4] = { GBRG, RGGB, GRBG, BGGR };
+
+		if (top >= bottom || left >= right || bottom > (uint32_t)img->height || right > (uint32_t)img->width)
+		{
+			printf("Invalid DNG active area\n");
+			return -1;
+		}
+		img->data += (size_t)top*img->stride + left*2;
+		img->width = right - left;
+		img->height = bottom - top;
+		if (left & 1)
+			img->bayer_order = hflip[img->bayer_order];
+		if (top & 1)
+			img->bayer_order = vflip[img->bayer_order];
+		if (top || left || bottom != ifd.height || right != ifd.width)
+			printf("Active area %u x %u at %u, %u\n", img->width, img->height, left, top);
+	}
+	return 0;
+}
+
+uint16_t black_level_correct(uint16_t raw_pixel, unsigned int black_level, unsigned int max_value)
+{
+	if (raw_pixel <= black_level)
+		return 0;
+	return ((raw_pixel - black_level) * max_value) / (max_value - black_level);
+}
+
+// The threshold is relative to the level of the neighbours above black,
+// which is non zero only for raw values. Raw neighbours below black count
+// as black, so only the noise floor applies there.
+static inline uint8_t is_defect(int px, int left, int right, int up, int down,
+		unsigned int threshold, unsigned int noise_floor, int black)
+{
+	int lo_h = min_int(left, right), hi_h = max_int(left, right);
+	int lo_v = min_int(up, down), hi_v = max_int(up, down);
+	int ref = (max_int(lo_h, lo_v) + min_int(hi_h, hi_v)) >> 1;
+	int dev = px - ref;
+	dev = dev < 0 ? -dev : dev;
+	return dev * 100 > max_int(ref - black, 0) * (int)threshold + (int)noise_floor * 100;
+}
+
+// Flag hot/dead pixels on one line of a single channel plane.
+// Each pixel is compared against the median of its four same colour
+// neighbours (left/right in this line, and the lines above and below).
+// The inner loop is branch free so that the compiler vectorises it.
+unsigned int detect_defects_line(const uint16_t *up, const uint16_t *cur, const uint16_t *down,
+		uint8_t *mask, int width, unsigned int threshold, unsigned int noise_floor, int black)
+{
+	unsigned int count;
+	int x;
+
+	//Mirror at the left and right edges
+	mask[0] = is_defect(cur[0], cur[1], cur[1], up[0], down[0], threshold, noise_floor, black);
+	mask[width-1] = is_defect(cur[width-1], cur[width-2], cur[width-2], up[width-1], down[width-1],
+			threshold, noise_floor, black);
+	count = mask[0] + mask[width-1];
+
+	for (x=1; x<width-1; x++)
+	{
+		uint8_t defect = is_defect(cur[x], cur[x-1], cur[x+1], up[x], down[x], threshold, noise_floor, black);
+		mask[x] = defect;
+		count += defect;
+	}
+	return count;
+}
+
+// Flag the defective pixels in lines y0 to y0+rows-1 of a channel plane.
+// channel and mask point at line y0. Where they exist in the image the lines
+// either side of the strip must also be present in channel, as they are
+// needed as neighbours. black is the black level still present in the
+// values, if they are not corrected.
+unsigned int detect_defects(const uint16_t *channel, uint8_t *mask, int width,
+		int y0, int rows, int height, unsigned int threshold, unsigned int noise_floor, int black)
+{
+	unsigned int count = 0;
+	int y;
+
+	if (width < 2 || height < 2)
+	{
+		memset(mask, 0, (size_t)width*rows);
+		return 0;
+	}
+
+	for (y=0; y<rows; y++)
+	{
+		//Mirror at the top and bottom edges
+		const uint16_t *up = &channel[(ptrdiff_t)(y0+y > 0 ? y-1 : y+1)*width];
+		const uint16_t *down = &channel[(ptrdiff_t)(y0+y < height-1 ? y+1 : y-1)*width];
+		count += detect_defects_line(up, &channel[(size_t)y*width], down, &mask[(size_t)y*width],
+				width, threshold, noise_floor, black);
+	}
+	return count;
+}
+
+// Range of lines or columns covered by the analysis window of grid cell
+// number cell, clipped to an image dimension of size
+static inline void window_range(uint32_t cell, int block_size, int size, int *start, int *stop)
+{
+	*start = cell*32+16-block_size/2;
+	if (*start >= size)
+		*start = size-1;
+	*stop = *start+block_size;
+	if (*stop > size)
+		*stop = size;
+}
+
+//Statistics of the pixels of each cell of one channel, gathered alongside
+//the block sums to judge the capture
+struct cell_stats {
+	uint32_t *sum;		//Of the pixels used, unscaled
+	uint64_t *sum_sq;
+	uint32_t *saturated;	//Pixels at or above sat_level
+	uint16_t sat_level;
+};
+
+typedef void (*block_sums_fn)(const uint16_t *channel, const uint8_t *mask,
+		int width, int height, int y0, uint32_t grid_width, uint32_t grid_y0, uint32_t grid_y1,
+		int block_size, uint32_t *block_sum, uint32_t *block_count, const struct cell_stats *stats);
+
+// Sum the analysis window around the centre of each grid cell in grid rows
+// grid_y0 to grid_y1-1. channel and mask point at line y0 of the plane,
+// and must hold all the lines of those grid rows.
+// Pixels flagged in mask (if not NULL) are excluded, and the sum rescaled
+// to a full window as is done for the partial blocks at the edges.
+// The number of pixels actually used is written to block_count if not NULL,
+// and their sum, sum of squares and saturated count to stats if not NULL.
+// Always inlined so that the specialisations below get a constant block_size,
+// and the loops over whole windows can be fully unrolled.
+static ALWAYS_INLINE void block_sums_kernel(const uint16_t *channel, const uint8_t *mask,
+		int width, int height, int y0, uint32_t grid_width, uint32_t grid_y0, uint32_t grid_y1,
+		const int block_size, uint32_t *block_sum, uint32_t *block_count, const struct cell_stats *stats)
+{
+	size_t block_idx = (size_t)grid_y0*grid_width;
+	uint32_t block_px_max = block_size*block_size;
+	uint32_t x, y;
+
+	for (y=grid_y0; y<grid_y1; y++)
+	{
+		int y_start, y_stop;
+		window_range(y, block_size, height, &y_start, &y_stop);
+
+		for (x=0; x<grid_width; x++)
+		{
+			int x_start, x_stop;
+			window_range(x, block_size, width, &x_start, &x_stop);
+
+			uint32_t block_val = 0;
+			uint32_t block_px = 0;
+			uint64_t block_sq = 0;
+			uint32_t block_sat = 0;
+
+			if (!mask && !stats && y_stop - y_start == block_size && x_stop - x_start == block_size)
+			{
+				//Whole window
+				for (int y_px = 0; y_px < block_size; y_px++)
+				{
+					const uint16_t *line = &channel[(size_t)(y_start+y_px-y0)*width + x_start];
+					for (int x_px = 0; x_px < block_size; x_px++)
+						block_val += line[x_px];
+				}
+				block_px = block_px_max;
+			}
+			else if (!mask && y_stop - y_start == block_size && x_stop - x_start == block_size)
+			{
+				//Whole window, with the statistics from the same loads
+				uint16_t sat_level = stats->sat_level;
+				for (int y_px = 0; y_px < block_size; y_px++)
+				{
+					const uint16_t *line = &channel[(size_t)(y_start+y_px-y0)*width + x_start];
+					for (int x_px = 0; x_px < block_size; x_px++)
+					{
+						uint32_t px = line[x_px];
+						block_val += px;
+						block_sq += px * px;
+						block_sat += px >= sat_level;
+					}
+				}
+				block_px = block_px_max;
+			}
+			else
+			{
+				for (int y_px = y_start; y_px < y_stop; y_px++)
+				{
+					const uint16_t *line = &channel[(size_t)(y_px-y0)*width];
+					const uint8_t *mask_line = mask ? &mask[(size_t)(y_px-y0)*width] : NULL;
+					for (int x_px = x_start; x_px < x_stop; x_px++)
+					{
+						uint32_t px = line[x_px];
+						if (mask_line && mask_line[x_px])
+							continue;
+						block_val += px;
+						block_px++;
+						if (stats)
+						{
+							block_sq += px * px;
+							block_sat += px >= stats->sat_level;
+						}
+					}
+				}
+			}
+			if (stats)
+			{
+				stats->sum[block_idx] = block_val;
+				stats->sum_sq[block_idx] = block_sq;
+				stats->saturated[block_idx] = block_sat;
+			}
+			if (block_px && block_px < block_px_max)
+				block_val = (uint64_t)block_val * block_px_max / block_px; // Scale sum in case of small edge blocks or masked pixels
+
+			if (block_count)
+				block_count[block_idx] = block_px;
+			block_sum[block_idx++] =  block_val ? block_val : 1;
+		}
+	}
+}
+
+void compute_block_sums(const uint16_t *channel, const uint8_t *mask,
+		int width, int height, int y0, uint32_t grid_width, uint32_t grid_y0, uint32_t grid_y1,
+		int block_size, uint32_t *block_sum, uint32_t *block_count, const struct cell_stats *stats)
+{
+	block_sums_kernel(channel, mask, width, height, y0, grid_width, grid_y0, grid_y1,
+			block_size, block_sum, block_count, stats);
+}
+
+#define DEFINE_BLOCK_SUMS(size) \
+void compute_block_sums_##size(const uint16_t *channel, const uint8_t *mask, \
+		int width, int height, int y0, uint32_t grid_width, uint32_t grid_y0, uint32_t grid_y1, \
+		int block_size, uint32_t *block_sum, uint32_t *block_count, const struct cell_stats *stats) \
+{ \
+	block_sums_kernel(channel, mask, width, height, y0, grid_width, grid_y0, grid_y1, \
+			size, block_sum, block_count, stats); \
+}
+
+DEFINE_BLOCK_SUMS(2)
+DEFINE_BLOCK_SUMS(4)
+DEFINE_BLOCK_SUMS(8)
+DEFINE_BLOCK_SUMS(16)
+DEFINE_BLOCK_SUMS(32)
+
+static int compare_uint16(const void *a, const void *b)
+{
+	return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// As compute_block_sums, but representing each window by the median of its
+// pixels, or if trimmed by the mean of those between the lower and upper
+// quartiles, which is then scaled up to the sum of a full window
+static void block_order_stats(const uint16_t *channel, const uint8_t *mask,
+		int width, int height, int y0, uint32_t grid_width, uint32_t grid_y0, uint32_t grid_y1,
+		int block_size, uint32_t *block_sum, uint32_t *block_count, const struct cell_stats *stats, int trimmed)
+{
+	size_t block_idx = (size_t)grid_y0*grid_width;
+	uint32_t block_px_max = block_size*block_size;
+	uint16_t values[32*32];
+	uint32_t x, y;
+
+	for (y=grid_y0; y<grid_y1; y++)
+	{
+		int y_start, y_stop;
+		window_range(y, block_size, height, &y_start, &y_stop);
+
+		for (x=0; x<grid_width; x++)
+		{
+			int x_start, x_stop, n = 0;
+			uint64_t block_val = 0;
+
+			window_range(x, block_size, width, &x_start, &x_stop);
+			for (int y_px = y_start; y_px < y_stop; y_px++)
+			{
+				const uint16_t *line = &channel[(size_t)(y_px-y0)*width];
+				const uint8_t *mask_line = mask ? &mask[(size_t)(y_px-y0)*width] : NULL;
+				for (int x_px = x_start; x_px < x_stop; x_px++)
+				{
+					if (!mask_line || !mask_line[x_px])
+						values[n++] = line[x_px];
+				}
+			}
+
+			if (stats)
+			{
+				uint32_t sum = 0, sat = 0;
+				uint64_t sq = 0;
+				for (int i = 0; i < n; i++)
+				{
+					sum += values[i];
+					sq += (uint32_t)values[i] * values[i];
+					sat += values[i] >= stats->sat_level;
+				}
+				stats->sum[block_idx] = sum;
+				stats->sum_sq[block_idx] = sq;
+				stats->saturated[block_idx] = sat;
+			}
+			if (n)
+			{
+				qsort(values, n, sizeof(uint16_t), compare_uint16);
+				if (trimmed)
+				{
+					int lo = n/4, hi = n - n/4;
+					for (int i = lo; i < hi; i++)
+						block_val += values[i];
+					block_val = block_val * block_px_max / (hi - lo);
+				}
+				else
+				{
+					block_val = (n & 1) ? values[n/2] : (values[n/2-1] + values[n/2] + 1) / 2;
+					block_val *= block_px_max;
+				}
+			}
+
+			if (block_count)
+				block_count[block_idx] = n;
+			block_sum[block_idx++] = block_val ? block_val : 1;
+		}
+	}
+}
+
+void compute_block_medians(const uint16_t *channel, const uint8_t *mask,
+		int width, int height, int y0, uint32_t grid_width, uint32_t grid_y0, uint32_t grid_y1,
+		int block_size, uint32_t *block_sum, uint32_t *block_count, const struct cell_stats *stats)
+{
+	block_order_stats(channel, mask, width, height, y0, grid_width, grid_y0, grid_y1,
+			block_size, block_sum, block_count, stats, 0);
+}
+
+void compute_block_trimmed(const uint16_t *channel, const uint8_t *mask,
+		int width, int height, int y0, uint32_t grid_width, uint32_t grid_y0, uint32_t grid_y1,
+		int block_size, uint32_t *block_sum, uint32_t *block_count, const struct cell_stats *stats)
+{
+	block_order_stats(channel, mask, width, height, y0, grid_width, grid_y0, grid_y1,
+			block_size, block_sum, block_count, stats, 1);
+}
+
+// Pick the block sum implementation for the estimator and analysis cell size, once
+block_sums_fn select_block_sums(int block_size, enum estimator_t estimator)
+{
+	if (estimator == EST_MEDIAN)
+		return compute_block_medians;
+	else if (estimator == EST_TRIMMED)
+		return compute_block_trimmed;
+
+	switch (block_size) {
+	case 2:
+		return compute_block_sums_2;
+	case 4:
+		return compute_block_sums_4;
+	case 8:
+		return compute_block_sums_8;
+	case 16:
+		return compute_block_sums_16;
+	case 32:
+		return compute_block_sums_32;
+	default:
+		return compute_block_sums;
+	}
+}
+
+// Box filter and decimate the channel plane down to the grid so that every
+// pixel contributes to the value of its cell. Lines y0 to y0+rows-1 (channel
+// and mask point at line y0) are added to the running totals in block_sum,
+// block_count and stats if not NULL, which must be zeroed before the first
+// line of the image.
+void accumulate_cell_sums(const uint16_t *channel, const uint8_t *mask,
+		int width, int y0, int rows, uint32_t grid_width,
+		uint32_t *block_sum, uint32_t *block_count, const struct cell_stats *stats)
+{
+	uint32_t x;
+	int y;
+
+	for (y=0; y<rows; y++)
+	{
+		const uint16_t *line = &channel[(size_t)y*width];
+		const uint8_t *mask_line = mask ? &mask[(size_t)y*width] : NULL;
+		uint32_t *row_sum = &block_sum[(size_t)((y0+y)/32)*grid_width];
+		uint32_t *row_count = &block_count[(size_t)((y0+y)/32)*grid_width];
+
+		for (x=0; x<grid_width; x++)
+		{
+			int x_start = x*32;
+			int x_stop = min_int(x_start+32, width);
+			uint32_t val = 0, px = 0;
+
+			if (stats)
+			{
+				//The statistics are gathered from the same loads
+				size_t cell = (size_t)((y0+y)/32)*grid_width + x;
+				uint64_t sq = 0;
+				uint32_t sat = 0;
+
+				for (int x_px = x_start; x_px < x_stop; x_px++)
+				{
+					uint32_t v = line[x_px];
+					if (mask_line && mask_line[x_px])
+						continue;
+					val += v;
+					px++;
+					sq += v * v;
+					sat += v >= stats->sat_level;
+				}
+				stats->sum[cell] += val;
+				stats->sum_sq[cell] += sq;
+				stats->saturated[cell] += sat;
+			}
+			else if (mask_line)
+			{
+				for (int x_px = x_start; x_px < x_stop; x_px++)
+				{
+					val += mask_line[x_px] ? 0 : line[x_px];
+					px += !mask_line[x_px];
+				}
+			}
+			else
+			{
+				for (int x_px = x_start; x_px < x_stop; x_px++)
+					val += line[x_px];
+				px = x_stop - x_start;
+			}
+			row_sum[x] += val;
+			row_count[x] += px;
+		}
+	}
+}
+
+// Scale the totals from accumulate_cell_sums to the size of an analysis
+// window so that they are interchangeable with those from compute_block_sums.
+void scale_cell_sums(uint32_t *block_sum, const uint32_t *block_count, size_t cells, int block_size)
+{
+	uint32_t block_px_max = block_size*block_size;
+	size_t i;
+
+	for (i=0; i<cells; i++)
+	{
+		uint32_t block_val = block_count[i] ? (uint64_t)block_sum[i] * block_px_max / block_count[i] : 0;
+		block_sum[i] = block_val ? block_val : 1;
+	}
+}
+
+// Apply the black level correction to block sums of raw values, as
+// black_level_correct does per pixel. The sums are those of a full window of
+// block_size*block_size pixels, so the black level is taken off that many
+// times before rescaling to the white level.
+void black_correct_block_sums(uint32_t *block_sum, size_t cells, int block_size,
+		unsigned int black_level, unsigned int max_val)
+{
+	uint64_t pedestal = (uint64_t)block_size*block_size*black_level;
+	size_t i;
+
+	for (i=0; i<cells; i++)
+	{
+		uint64_t block_val = block_sum[i] > pedestal ?
+				(block_sum[i] - pedestal) * max_val / (max_val - black_level) : 0;
+		if (block_val > UINT32_MAX)
+			block_val = UINT32_MAX;
+		block_sum[i] = block_val ? block_val : 1;
+	}
+}
+
+uint32_t max_block_sum(const uint32_t *block_sum, size_t cells)
+{
+	uint32_t max_blk_val = 0;
+	size_t i;
+
+	for (i=0; i<cells; i++)
+	{
+		if (block_sum[i] > max_blk_val)
+			max_blk_val = block_sum[i];
+	}
+	return max_blk_val;
+}
+
+// Unpackers for one line of Bayer data, splitting it into the two channels
+// present on the line. Each is a simple loop over whole groups of pixels so
+// that the compiler can vectorise it.
+// The packing is as MIPI CSI-2: RAW10 has the 8 MSBs of 4 pixels followed by
+// a byte of their 2 LSBs (first pixel in bits 1:0), RAW12 the 8 MSBs of 2
+// pixels followed by a byte of their 4 LSBs (first pixel in bits 3:0).
+void unpack_raw10_line(const uint8_t *line, int width, uint16_t *chan_a_line, uint16_t *chan_b_line)
+{
+	int groups = width / 4;
+	int i = 0;
+
+#ifdef HAVE_VECTOR_EXT
+	// The 5 byte groups defeat the auto-vectoriser, so take 4 groups at a
+	// time from two overlapping 16 byte loads, and shuffle the MSBs and
+	// LSBs into place.
+	static const v16u8 msb_mask = { 0, 2, 5, 7, 10, 12, 15, 29, 1, 3, 6, 8, 11, 13, 28, 30 };
+	static const v16u8 lsb_mask = { 4, 4, 9, 9, 14, 14, 31, 31, 4, 4, 9, 9, 14, 14, 31, 31 };
+	//Multiply and shift right by 6 to extract the LSBs for each pixel
+	static const v8u16 lsb_mul_a = { 64, 4, 64, 4, 64, 4, 64, 4 };
+	static const v8u16 lsb_mul_b = { 16, 1, 16, 1, 16, 1, 16, 1 };
+
+	for (; i+4<=groups; i+=4)
+	{
+		v16u8 v0, v1, msb, lsb;
+		v8u8 msb_a, msb_b, lsb8;
+		v8u16 lsbs, a, b;
+
+		memcpy(&v0, &line[i*5], 16);
+		memcpy(&v1, &line[i*5+4], 16);
+		msb = __builtin_shuffle(v0, v1, msb_mask);
+		lsb = __builtin_shuffle(v0, v1, lsb_mask);
+		memcpy(&msb_a, &msb, 8);
+		memcpy(&msb_b, (uint8_t *)&msb + 8, 8);
+		memcpy(&lsb8, &lsb, 8);
+		lsbs = __builtin_convertvector(lsb8, v8u16);
+		a = (__builtin_convertvector(msb_a, v8u16) << 2) | (((lsbs * lsb_mul_a) >> 6) & 3);
+		b = (__builtin_convertvector(msb_b, v8u16) << 2) | (((lsbs * lsb_mul_b) >> 6) & 3);
+		memcpy(&chan_a_line[i*2], &a, 16);
+		memcpy(&chan_b_line[i*2], &b, 16);
+	}
+#endif
+	for (; i<groups; i++)
+	{
+		const uint8_t *group = &line[i*5];
+		uint8_t lsbs = group[4];
+		chan_a_line[i*2] = (group[0]<<2) | (lsbs&0x03);
+		chan_b_line[i*2] = (group[1]<<2) | ((lsbs>>2)&0x03);
+		chan_a_line[i*2+1] = (group[2]<<2) | ((lsbs>>4)&0x03);
+		chan_b_line[i*2+1] = (group[3]<<2) | (lsbs>>6);
+	}
+	if (width & 2)
+	{
+		//Partial group at the end of the line
+		const uint8_t *group = &line[groups*5];
+		chan_a_line[groups*2] = (group[0]<<2) | (group[4]&0x03);
+		chan_b_line[groups*2] = (group[1]<<2) | ((group[4]>>2)&0x03);
+	}
+}
+
+void unpack_raw12_line(const uint8_t *line, int width, uint16_t *chan_a_line, uint16_t *chan_b_line)
+{
+	int groups = width / 2;
+	int i;
+
+	for (i=0; i<groups; i++)
+	{
+		const uint8_t *group = &line[i*3];
+		chan_a_line[i] = (group[0]<<4) | (group[2]&0x0F);
+		chan_b_line[i] = (group[1]<<4) | (group[2]>>4);
+	}
+}
+
+static ALWAYS_INLINE void unpack_raw16_line(const uint8_t *line, int width, const int big_endian,
+		uint16_t *chan_a_line, uint16_t *chan_b_line)
+{
+	int groups = width / 2;
+	int lsb = big_endian ? 1 : 0;
+	int i;
+
+	for (i=0; i<groups; i++)
+	{
+		const uint8_t *group = &line[i*4];
+		chan_a_line[i] = group[lsb] | (group[1-lsb]<<8);
+		chan_b_line[i] = group[2+lsb] | (group[3-lsb]<<8);
+	}
+}
+
+//Offset the PiSP front end subtracts before compression
+#define PISP_COMPRESS_OFFSET 2048
+
+static inline int pisp_dequantise(int q, int qmode)
+{
+	int v0 = q < 320 ? 16 * q : 32 * (q - 160);
+	int v3 = q < 94 ? 256 * q : min_int(512 * (q - 47), 0xFFFF);
+	return qmode == 0 ? v0 : qmode == 1 ? 64 * q : qmode == 2 ? 128 * q : v3;
+}
+
+// Decode the 4 pixels held in one 32 bit word of PiSP compressed data.
+// The bottom 2 bits give the quantisation mode. Modes 0 to 2 code the middle
+// pair as a base and delta, and the outer pixels relative to them. Mode 3
+// quantises each pixel independently. Both are evaluated and the result
+// selected, keeping the loop over words free of branches.
+static inline void pisp_decode_word(uint32_t w, uint16_t *d)
+{
+	int qmode = w & 3;
+	int field0 = (w >> 2) & 511;
+	int field1 = (w >> 11) & 127;
+	int field2 = (w >> 18) & 127;
+	int field3 = w >> 25;
+	int pack0 = (w >> 2) & 32767;
+	int pack1 = (w >> 17) & 32767;
+	int high = qmode == 2 && field0 >= 384;
+	int q1 = high ? field0 : field1 >= 64 ? field0 : field0 + 64 - field1;
+	int q2 = high ? field1 + 384 : field1 >= 64 ? field0 + field1 - 64 : field0;
+	int p1 = max_int(0, q1 - 64);
+	int p2 = max_int(0, q2 - 64);
+	int q[4];
+	int i;
+
+	if (qmode == 2)
+	{
+		p1 = min_int(384, p1);
+		p2 = min_int(384, p2);
+	}
+	q[0] = qmode == 3 ? (pack0 & 15) + 16 * ((pack0 >> 8) / 11) : p1 + field2;
+	q[1] = qmode == 3 ? (pack0 >> 4) % 176 : q1;
+	q[2] = qmode == 3 ? (pack1 & 15) + 16 * ((pack1 >> 8) / 11) : q2;
+	q[3] = qmode == 3 ? (pack1 >> 4) % 176 : p2 + field3;
+
+	for (i=0; i<4; i++)
+		d[i] = min_int(pisp_dequantise(q[i], qmode) + PISP_COMPRESS_OFFSET, 0xFFFF);
+}
+
+// PiSP compressed Bayer, libcamera's <order>_PISP_COMP1. Each block of 8
+// pixels is two little endian 32 bit words, the first holding the 4 even
+// (chan_a) pixels and the second the 4 odd (chan_b) ones.
+void unpack_pisp_comp1_line(const uint8_t *line, int width, uint16_t *chan_a_line, uint16_t *chan_b_line)
+{
+	int blocks = width / 8;
+	int i;
+
+	for (i=0; i<blocks; i++)
+	{
+		const uint8_t *block = &line[i*8];
+		pisp_decode_word(block[0] | (block[1]<<8) | (block[2]<<16) | ((uint32_t)block[3]<<24), &chan_a_line[i*4]);
+		pisp_decode_word(block[4] | (block[5]<<8) | (block[6]<<16) | ((uint32_t)block[7]<<24), &chan_b_line[i*4]);
+	}
+	if (width & 7)
+	{
+		//Partial block at the end of the line, in the padding of the stride
+		const uint8_t *block = &line[blocks*8];
+		uint16_t a[4], b[4];
+		pisp_decode_word(block[0] | (block[1]<<8) | (block[2]<<16) | ((uint32_t)block[3]<<24), a);
+		pisp_decode_word(block[4] | (block[5]<<8) | (block[6]<<16) | ((uint32_t)block[7]<<24), b);
+		memcpy(&chan_a_line[blocks*4], a, (width & 7)/2 * sizeof(uint16_t));
+		memcpy(&chan_b_line[blocks*4], b, (width & 7)/2 * sizeof(uint16_t));
+	}
+}
+
+void unpack_raw16_le_line(const uint8_t *line, int width, uint16_t *chan_a_line, uint16_t *chan_b_line)
+{
+	unpack_raw16_line(line, width, 0, chan_a_line, chan_b_line);
+}
+
+void unpack_raw16_be_line(const uint8_t *line, int width, uint16_t *chan_a_line, uint16_t *chan_b_line)
+{
+	unpack_raw16_line(line, width, 1, chan_a_line, chan_b_line);
+}
+
+typedef void (*unpack_fn)(const uint8_t *line, int width, uint16_t *chan_a_line, uint16_t *chan_b_line);
+
+//Unpacker for each packing, selected once the input format is known
+const unpack_fn unpackers[] = {
+	[PACKING_RAW10] = unpack_raw10_line,
+	[PACKING_RAW12] = unpack_raw12_line,
+	[PACKING_RAW16] = unpack_raw16_le_line,
+	[PACKING_RAW16_BE] = unpack_raw16_be_line,
+	[PACKING_PISP_COMP1] = unpack_pisp_comp1_line
+};
+
+// Apply the black level correction to count samples through the table
+// black_lut, from src to dst which may be the same
+void apply_black_lut(const uint16_t *src, uint16_t *dst, size_t count, const uint16_t *black_lut)
+{
+	size_t i;
+
+	for (i=0; i<count; i++)
+		dst[i] = black_lut[src[i]];
+}
+
+// Number of entries needed in the black level table for a packing
+size_t packing_range(enum raw_packing_t packing)
+{
+	switch (packing) {
+	case PACKING_RAW10:
+		return 1 << 10;
+	case PACKING_RAW12:
+		return 1 << 12;
+	default:
+		return 1 << 16;
+	}
+}
+
+// Parse a libcamera pixel format name, eg SRGGB10_CSI2P, SBGGR16 or
+// RGGB_PISP_COMP1, for headerless raw buffers.
+int parse_pixel_format(const char *name, struct raw_image *img)
+{
+	static const char *orders[4] = { "RGGB", "GBRG", "BGGR", "GRBG" };
+	int bits;
+	char *end;
+
+	if (strlen(name) == 15 && !strcmp(&name[4], "_PISP_COMP1"))
+	{
+		for (img->bayer_order=0; img->bayer_order<4; img->bayer_order++)
+		{
+			if (!strncmp(name, orders[img->bayer_order], 4))
+				break;
+		}
+		if (img->bayer_order == 4)
+			return -1;
+		img->packing = PACKING_PISP_COMP1;
+		img->max_val = 0xFFFF;
+		img->black_level = 4096;
+		img->transform = 0;
+		img->model[0] = '\0';
+		return 0;
+	}
+
+	if (name[0] != 'S' || strlen(name) < 7)
+		return -1;
+	for (img->bayer_order=0; img->bayer_order<4; img->bayer_order++)
+	{
+		if (!strncmp(&name[1], orders[img->bayer_order], 4))
+			break;
+	}
+	if (img->bayer_order == 4)
+		return -1;
+
+	bits = strtoul(&name[5], &end, 10);
+	if (!strcmp(end, "_CSI2P") && bits == 10)
+		img->packing = PACKING_RAW10;
+	else if (!strcmp(end, "_CSI2P") && bits == 12)
+		img->packing = PACKING_RAW12;
+	else if (*end == '\0' && bits >= 10 && bits <= 16)
+		img->packing = PACKING_RAW16;
+	else
+		return -1;
+
+	img->max_val = (1 << bits) - 1;
+	//Nominal black level of the Pi sensors, 4096 in 16 bit terms
+	img->black_level = (img->max_val + 1) / 16;
+	img->transform = 0;
+	img->model[0] = '\0';
+	return 0;
+}
+
+// Minimum line length in bytes for a packing
+size_t packing_stride(enum raw_packing_t packing, int width)
+{
+	switch (packing) {
+	case PACKING_RAW10:
+		//Lines are whole groups of 4 pixels in 5 bytes, as CSI-2 pads them
+		return ((size_t)width + 3) / 4 * 5;
+	case PACKING_RAW12:
+		return ((size_t)width*3 + 1) / 2;
+	case PACKING_PISP_COMP1:
+		return ((size_t)width + 7) & ~7;
+	default:
+		return (size_t)width*2;
+	}
+}
+
+//Description of a headerless raw buffer given on the command line
+struct raw_format {
+	const char *pixel_format;	//NULL to detect the file type
+	int width, height;
+	size_t stride, offset;
+};
+
+// Find the Bayer data in a raw file mapped at buf: a headerless buffer as
+// described by fmt, a DNG, or a Broadcom raw optionally appended to a JPEG
+int parse_raw_file(uint8_t *buf, size_t size, const struct raw_format *fmt, struct raw_image *img)
+{
+	uint8_t *in_buf = buf;
+
+	memset(img, 0, sizeof(*img));
+	if (fmt->pixel_format)
+	{
+		if (parse_pixel_format(fmt->pixel_format, img))
+		{
+			printf("Unknown pixel format %s\n", fmt->pixel_format);
+			return -1;
+		}
+		if (fmt->width <= 0 || fmt->height <= 0)
+		{
+			printf("--width and --height are needed with --format\n");
+			return -1;
+		}
+		img->width = fmt->width;
+		img->height = fmt->height;
+		img->stride = fmt->stride ? fmt->stride : packing_stride(img->packing, fmt->width);
+		img->data = buf + fmt->offset;
+		if (img->stride < packing_stride(img->packing, fmt->width))
+		{
+			printf("Stride %zu is too small for the width\n", img->stride);
+			return -1;
+		}
+		if (fmt->offset + img->stride*(img->height-1) + packing_stride(img->packing, fmt->width) > size)
+		{
+			printf("Raw file is too small for the image size\n");
+			return -1;
+		}
+		printf("Format %s, width %d, height %d, stride %zu\n", fmt->pixel_format, img->width, img->height, img->stride);
+		return 0;
+	}
+	if (size >= 8 && (!memcmp(buf, "II*\0", 4) || !memcmp(buf, "MM\0*", 4)))
+		return parse_dng(buf, size, img);
+
+	if (size >= 2 && !memcmp(buf, "\xff\xd8", 2))
+	{
+		int sensor_model = 1;
+		do
+		{
+			in_buf = sensor_model_check(sensor_model, buf, size);
+		}
+		while(in_buf == 0 && sensor_model++ <= 3);
+
+		if (in_buf == 0)
+		{
+			in_buf = buf;
+		}
+	}
+	return parse_brcm_raw(in_buf, size - (in_buf - buf), img);
+}
+
+// Parse a size in bytes with an optional k, M or G suffix
+size_t parse_size(const char *str)
+{
+	char *end;
+	unsigned long long size = strtoull(str, &end, 10);
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		size <<= 10;
+		break;
+	}
+	return size;
+}
+
+// Write out all of an I/O vector, continuing after short writes
+int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0)
+	{
+		ssize_t done = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (done < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)done >= iov->iov_len)
+		{
+			done -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (uint8_t*)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+	return 0;
+}
+
+static inline void put_le16(uint8_t *p, uint16_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+}
+
+static inline void put_le32(uint8_t *p, uint32_t val)
+{
+	put_le16(p, val);
+	put_le16(p + 2, val >> 16);
+}
+
+//Names of the channel plane files for each plane format, bar PLANE_LSC
+const char *const plane_filenames[][NUM_CHANNELS] = {
+	{ "ch1.bin", "ch2.bin", "ch3.bin", "ch4.bin" },
+	{ "ch1.pgm", "ch2.pgm", "ch3.pgm", "ch4.pgm" },
+	{ "ch1.tif", "ch2.tif", "ch3.tif", "ch4.tif" }
+};
+
+// Build the file header for a channel plane of 16 bit samples into hdr,
+// which must hold PLANE_HEADER_MAX bytes. Returns the header length.
+size_t plane_header(enum plane_format_t format, int width, int height, unsigned int max_val, uint8_t *hdr)
+{
+	switch (format) {
+	case PLANE_PGM:
+		return sprintf((char*)hdr, "P5\n%d %d\n%u\n", width, height, max_val);
+	case PLANE_TIFF:
+	{
+		//Single strip greyscale image, with the data following the header
+		const uint32_t entries[][3] = {
+			{ 256, 4, width },		//ImageWidth
+			{ 257, 4, height },		//ImageLength
+			{ 258, 3, 16 },			//BitsPerSample
+			{ 259, 3, 1 },			//Compression, none
+			{ 262, 3, 1 },			//PhotometricInterpretation, BlackIsZero
+			{ 273, 4, PLANE_HEADER_MAX },	//StripOffsets
+			{ 277, 3, 1 },			//SamplesPerPixel
+			{ 278, 4, height },		//RowsPerStrip
+			{ 279, 4, (uint32_t)width*height*2 }	//StripByteCounts
+		};
+		int num_entries = sizeof(entries) / sizeof(entries[0]);
+		int i;
+
+		memset(hdr, 0, PLANE_HEADER_MAX);
+		memcpy(hdr, "II*\0", 4);
+		put_le32(hdr + 4, 8);
+		put_le16(hdr + 8, num_entries);
+		for (i=0; i<num_entries; i++)
+		{
+			uint8_t *entry = hdr + 10 + i*12;
+			put_le16(entry, entries[i][0]);
+			put_le16(entry + 2, entries[i][1]);
+			put_le32(entry + 4, 1);
+			//Values are left justified, which for little endian SHORTs is the same
+			put_le32(entry + 8, entries[i][2]);
+		}
+		return PLANE_HEADER_MAX;
+	}
+	default:
+		return 0;
+	}
+}
+
+// Convert 16 bit samples to big endian in place, for PGM output
+void swap_bytes16(uint16_t *data, size_t count)
+{
+	size_t i;
+
+	for (i=0; i<count; i++)
+		data[i] = (data[i] >> 8) | (data[i] << 8);
+}
+
+// Add the rows y0 to y0+rows-1 of a channel to the box sums of its preview,
+// which is downsampled by factor in each direction. Partial boxes at the
+// right and bottom edges are dropped. Always inlined so that the common
+// factors below get a constant one, and the box sums become vector reductions.
+static ALWAYS_INLINE void preview_kernel(const uint16_t *channel, int width, int y0, int rows,
+		const int factor, int preview_width, int preview_height, uint32_t *preview_sum)
+{
+	int x, y, px;
+
+	for (y=0; y<rows && (y0+y)/factor < preview_height; y++)
+	{
+		const uint16_t *line = channel + (size_t)y*width;
+		uint32_t *sum = preview_sum + (size_t)((y0+y)/factor)*preview_width;
+
+		for (px=0; px<preview_width; px++)
+		{
+			uint32_t box = 0;
+			for (x=0; x<factor; x++)
+				box += line[px*factor + x];
+			sum[px] += box;
+		}
+	}
+}
+
+void accumulate_preview(const uint16_t *channel, int width, int y0, int rows,
+		int factor, int preview_width, int preview_height, uint32_t *preview_sum)
+{
+	switch (factor) {
+	case 2:
+		preview_kernel(channel, width, y0, rows, 2, preview_width, preview_height, preview_sum);
+		break;
+	case 4:
+		preview_kernel(channel, width, y0, rows, 4, preview_width, preview_height, preview_sum);
+		break;
+	case 8:
+		preview_kernel(channel, width, y0, rows, 8, preview_width, preview_height, preview_sum);
+		break;
+	case 16:
+		preview_kernel(channel, width, y0, rows, 16, preview_width, preview_height, preview_sum);
+		break;
+	default:
+		preview_kernel(channel, width, y0, rows, factor, preview_width, preview_height, preview_sum);
+		break;
+	}
+}
+
+//A text file written through a buffer with a fast integer formatter, for the
+//outputs with a line for every cell or pixel
+struct text_file {
+	int fd;
+	int failed;
+	size_t len;
+	char buf[TEXT_BUF_SIZE];
+};
+
+static const char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+// Format v in decimal at p, two digits at a time. Returns the end.
+static inline char *format_uint(char *p, uint32_t v)
+{
+	char digits[10], *d = digits + sizeof(digits);
+	size_t n;
+
+	while (v >= 100)
+	{
+		d -= 2;
+		memcpy(d, &digit_pairs[(v % 100) * 2], 2);
+		v /= 100;
+	}
+	if (v >= 10)
+	{
+		d -= 2;
+		memcpy(d, &digit_pairs[v * 2], 2);
+	}
+	else
+		*--d = '0' + v;
+	n = digits + sizeof(digits) - d;
+	memcpy(p, d, n);
+	return p + n;
+}
+
+struct text_file *text_open(const char *filename)
+{
+	struct text_file *tf = (struct text_file *)malloc(sizeof(struct text_file));
+
+	if (tf)
+	{
+		tf->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		tf->failed = 0;
+		tf->len = 0;
+		if (tf->fd < 0)
+		{
+			free(tf);
+			tf = NULL;
+		}
+	}
+	if (!tf)
+		printf("Failed to write %s\n", filename);
+	return tf;
+}
+
+static void text_flush(struct text_file *tf)
+{
+	struct iovec iov = { tf->buf, tf->len };
+
+	if (tf->len && writev_all(tf->fd, &iov, 1))
+		tf->failed = 1;
+	tf->len = 0;
+}
+
+// Append a string of up to TEXT_BUF_SIZE/2 characters
+static inline void text_str(struct text_file *tf, const char *str)
+{
+	size_t n = strlen(str);
+
+	if (tf->len + n > TEXT_BUF_SIZE)
+		text_flush(tf);
+	memcpy(tf->buf + tf->len, str, n);
+	tf->len += n;
+}
+
+// Append v in decimal followed by the separator sep
+static inline void text_uint(struct text_file *tf, uint32_t v, const char *sep)
+{
+	if (tf->len + 10 > TEXT_BUF_SIZE)
+		text_flush(tf);
+	tf->len = format_uint(tf->buf + tf->len, v) - tf->buf;
+	text_str(tf, sep);
+}
+
+// Append a short formatted line, for the headers of the files
+static void text_printf(struct text_file *tf, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	if (tf->len + 256 > TEXT_BUF_SIZE)
+		text_flush(tf);
+	va_start(args, fmt);
+	n = vsnprintf(tf->buf + tf->len, 256, fmt, args);
+	va_end(args);
+	tf->len += n < 256 ? n : 255;
+}
+
+// Append v with up to 4 decimal places, rounded as printf does, followed by
+// the separator sep
+static void text_fixed(struct text_file *tf, double v, int decimals, const char *sep)
+{
+	static const uint32_t scale[5] = { 1, 10, 100, 1000, 10000 };
+	double scaled = fabs(v) * scale[decimals], whole = floor(scaled);
+	uint32_t frac;
+	uint64_t units;
+	char *p;
+	int i;
+
+	//Near a tie the product may have rounded either way, so printf decides
+	if (!(scaled < 4e9) || fabs(scaled - whole - 0.5) < 1e-6)
+	{
+		char str[64];
+
+		snprintf(str, sizeof(str), "%.*f", decimals, v);
+		text_str(tf, str);
+		text_str(tf, sep);
+		return;
+	}
+	units = (uint64_t)whole + (scaled - whole > 0.5);
+	if (tf->len + 24 > TEXT_BUF_SIZE)
+		text_flush(tf);
+	p = tf->buf + tf->len;
+	if (signbit(v))
+		*p++ = '-';
+	p = format_uint(p, units / scale[decimals]);
+	if (decimals)
+	{
+		*p++ = '.';
+		frac = units % scale[decimals];
+		for (i=decimals-1; i>=0; i--, frac/=10)
+			p[i] = '0' + frac % 10;
+		p += decimals;
+	}
+	tf->len = p - tf->buf;
+	text_str(tf, sep);
+}
+
+// Flush and close the file, returning -1 if any of it failed to write
+int text_close(struct text_file *tf)
+{
+	int ret;
+
+	text_flush(tf);
+	ret = close(tf->fd) || tf->failed ? -1 : 0;
+	free(tf);
+	return ret;
+}
+
+// Write the preview of a channel from its box sums as a 16 bit PGM
+int write_preview(const char *filename, const uint32_t *preview_sum, int width, int height,
+		int factor, unsigned int max_val)
+{
+	uint8_t hdr[PLANE_HEADER_MAX];
+	struct iovec iov[2];
+	size_t i, count = (size_t)width*height;
+	uint32_t box = (uint32_t)factor*factor;
+	uint16_t *preview;
+	int fd, ret;
+
+	preview = (uint16_t *)malloc(count * sizeof(uint16_t));
+	if (!preview)
+		return -1;
+	for (i=0; i<count; i++)
+		preview[i] = (preview_sum[i] + box/2) / box;
+	swap_bytes16(preview, count);
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = plane_header(PLANE_PGM, width, height, max_val, hdr);
+	iov[1].iov_base = preview;
+	iov[1].iov_len = count * sizeof(uint16_t);
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ret = fd < 0 ? -1 : writev_all(fd, iov, 2);
+	if (fd >= 0)
+		close(fd);
+	free(preview);
+	if (ret)
+		printf("Failed to write %s\n", filename);
+	return ret;
+}
+
+// Write the previews of all four channels as one CSV heatmap, with a line
+// for each box giving its centre in sensor pixels and the mean of each
+// channel in the order R, Gr, Gb, B. A blank line ends each row of boxes, as
+// gnuplot expects between the scan lines of a surface.
+int write_heatmap(const char *filename, uint32_t *const preview_sum[NUM_CHANNELS], const int *ordering,
+		int width, int height, int factor)
+{
+	struct text_file *tf = text_open(filename);
+	uint32_t box = (uint32_t)factor*factor;
+	int i, x, y;
+
+	if (!tf)
+		return -1;
+	text_str(tf, "x,y,r,gr,gb,b\n");
+	for (y=0; y<height; y++)
+	{
+		for (x=0; x<width; x++)
+		{
+			size_t idx = (size_t)y*width + x;
+
+			text_uint(tf, x*factor*2 + factor, ",");
+			text_uint(tf, y*factor*2 + factor, ",");
+			for (i=0; i<NUM_CHANNELS; i++)
+				text_uint(tf, (preview_sum[ordering[i]][idx] + box/2) / box, i < NUM_CHANNELS-1 ? "," : "\n");
+		}
+		text_str(tf, "\n");
+	}
+	if (text_close(tf))
+	{
+		printf("Failed to write %s\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+// Work shared between the worker threads. Each job is job_size bytes
+// into jobs, and the workers take the next job until none are left.
+struct job_queue {
+	void (*fn)(void *job);
+	uint8_t *jobs;
+	size_t job_size;
+	int num_jobs;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static void *job_worker(void *arg)
+{
+	struct job_queue *queue = (struct job_queue *)arg;
+
+	for (;;)
+	{
+		int i;
+
+		pthread_mutex_lock(&queue->lock);
+		i = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (i >= queue->num_jobs)
+			break;
+		queue->fn(queue->jobs + (size_t)i*queue->job_size);
+	}
+	return NULL;
+}
+
+// Run fn on each of num_jobs jobs using up to num_threads threads,
+// including the calling one
+void run_jobs(void (*fn)(void *job), void *jobs, size_t job_size, int num_jobs, int num_threads)
+{
+	struct job_queue queue = { fn, (uint8_t *)jobs, job_size, num_jobs, 0, PTHREAD_MUTEX_INITIALIZER };
+	pthread_t threads[MAX_THREADS];
+	int i, started = 0;
+
+	num_threads = min_int(min_int(num_threads, num_jobs), MAX_THREADS);
+	for (i=1; i<num_threads; i++)
+	{
+		if (pthread_create(&threads[started], NULL, job_worker, &queue))
+			break;
+		started++;
+	}
+	job_worker(&queue);
+	for (i=0; i<started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static inline uint32_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	return get_le16(p) | (get_le16(p + 2) << 16);
+}
+
+// Number of bits needed for samples up to max_val
+int sample_bits(unsigned int max_val)
+{
+	int bits = 1;
+
+	while (bits < 16 && (1U << bits) <= max_val)
+		bits++;
+	return bits;
+}
+
+struct bit_writer {
+	uint8_t *buf;
+	size_t pos;
+	uint64_t acc;
+	int bits;
+};
+
+static inline void put_bits(struct bit_writer *bw, uint32_t val, int n)
+{
+	bw->acc = (bw->acc << n) | (val & ((1ULL << n) - 1));
+	bw->bits += n;
+	while (bw->bits >= 8)
+	{
+		bw->bits -= 8;
+		bw->buf[bw->pos++] = bw->acc >> bw->bits;
+	}
+}
+
+static inline void flush_bits(struct bit_writer *bw)
+{
+	if (bw->bits)
+		bw->buf[bw->pos++] = bw->acc << (8 - bw->bits);
+	bw->bits = 0;
+}
+
+struct bit_reader {
+	const uint8_t *buf;
+	size_t size;
+	size_t pos;
+	uint64_t acc;
+	int bits;
+};
+
+// Make at least 32 bits available, reading zeros past the end of the data
+static inline void fill_bits(struct bit_reader *br)
+{
+	while (br->bits < 32)
+	{
+		br->acc = (br->acc << 8) | (br->pos < br->size ? br->buf[br->pos] : 0);
+		br->pos++;
+		br->bits += 8;
+	}
+}
+
+static inline uint32_t get_bits(struct bit_reader *br, int n)
+{
+	fill_bits(br);
+	br->bits -= n;
+	return (br->acc >> br->bits) & ((1ULL << n) - 1);
+}
+
+// Read a unary coded value of up to max ones (max < 32), the terminating
+// zero being absent when the limit is reached
+static inline int get_unary(struct bit_reader *br, int max)
+{
+	int q;
+
+	fill_bits(br);
+#ifdef __GNUC__
+	{
+		uint32_t window = (br->acc << (64 - br->bits)) >> 32;
+		q = ~window ? __builtin_clz(~window) : 32;
+	}
+	if (q > max)
+		q = max;
+	br->bits -= q + (q < max);
+#else
+	for (q=0; q<max && get_bits(br, 1); q++)
+		;
+#endif
+	return q;
+}
+
+// Map a prediction residual to an unsigned value: 0, -1, 1, -2, ...
+static inline uint32_t zigzag(int d)
+{
+	return d < 0 ? -2*d - 1 : 2*d;
+}
+
+// Predict each sample from its left neighbour, or the one above for the
+// first of the row, with rows coded as Rice codes of the zigzagged residual.
+// The Rice parameter is chosen per row from the mean residual, and a row
+// that wouldn't shrink is stored packed to bits per sample instead.
+void lsc_encode_row(struct bit_writer *bw, const uint16_t *row, const uint16_t *above, int width, int bits)
+{
+	uint64_t sum = 0, cost = 0;
+	int x, k = 0;
+
+	for (x=0; x<width; x++)
+		sum += zigzag(row[x] - (x ? row[x-1] : above ? above[0] : 0));
+	while (k < bits && ((uint64_t)width << (k+1)) <= sum)
+		k++;
+	for (x=0; x<width; x++)
+	{
+		uint32_t q = zigzag(row[x] - (x ? row[x-1] : above ? above[0] : 0)) >> k;
+		cost += q < RICE_ESCAPE ? q + 1 + k : RICE_ESCAPE + bits + 1;
+	}
+
+	if (cost >= (uint64_t)width*bits)
+	{
+		put_bits(bw, RICE_RAW_ROW, 5);
+		for (x=0; x<width; x++)
+			put_bits(bw, row[x], bits);
+		return;
+	}
+
+	put_bits(bw, k, 5);
+	for (x=0; x<width; x++)
+	{
+		uint32_t v = zigzag(row[x] - (x ? row[x-1] : above ? above[0] : 0));
+		uint32_t q = v >> k;
+		if (q < RICE_ESCAPE)
+		{
+			put_bits(bw, ((1U << q) - 1) << 1, q + 1);
+			put_bits(bw, v, k);
+		}
+		else
+		{
+			put_bits(bw, (1U << RICE_ESCAPE) - 1, RICE_ESCAPE);
+			put_bits(bw, v, bits + 1);
+		}
+	}
+}
+
+void lsc_decode_row(struct bit_reader *br, uint16_t *row, const uint16_t *above, int width, int bits)
+{
+	int x, k = get_bits(br, 5);
+
+	if (k == RICE_RAW_ROW)
+	{
+		for (x=0; x<width; x++)
+			row[x] = get_bits(br, bits);
+		return;
+	}
+
+	for (x=0; x<width; x++)
+	{
+		int pred = x ? row[x-1] : above ? above[0] : 0;
+		int q = get_unary(br, RICE_ESCAPE);
+		uint32_t v = q < RICE_ESCAPE ? ((uint32_t)q << k) | get_bits(br, k) : get_bits(br, bits + 1);
+		row[x] = pred + (int)((v >> 1) ^ -(v & 1));
+	}
+}
+
+// Largest coded size of a block
+size_t lsc_block_bound(int width, int rows, int bits)
+{
+	return ((size_t)rows * (5 + (size_t)width*bits) + 7) / 8;
+}
+
+//A block of one channel plane, coded or decoded by a worker thread
+struct lsc_block {
+	uint16_t *plane;	//First row of the block
+	int width;
+	int rows;
+	int bits;
+	uint8_t *buf;		//Coded data
+	size_t size;
+	int skip;		//Rows at the start of the block not wanted when decoding
+	int keep;		//Rows wanted when decoding
+};
+
+static void lsc_encode_block(void *job)
+{
+	struct lsc_block *block = (struct lsc_block *)job;
+	struct bit_writer bw = { block->buf, 0, 0, 0 };
+	int y;
+
+	for (y=0; y<block->rows; y++)
+	{
+		const uint16_t *row = block->plane + (size_t)y*block->width;
+		lsc_encode_row(&bw, row, y ? row - block->width : NULL, block->width, block->bits);
+	}
+	flush_bits(&bw);
+	block->size = bw.pos;
+}
+
+static void lsc_decode_block(void *job)
+{
+	struct lsc_block *block = (struct lsc_block *)job;
+	struct bit_reader br = { block->buf, block->size, 0, 0, 0 };
+	uint16_t *out = block->plane;
+	int y;
+
+	//Only decode to the output directly if all of the block is wanted
+	if (block->skip || block->keep < block->rows)
+	{
+		out = (uint16_t *)malloc((size_t)block->rows*block->width*sizeof(uint16_t));
+		if (!out)
+			return;
+	}
+	for (y=0; y<block->rows; y++)
+	{
+		uint16_t *row = out + (size_t)y*block->width;
+		lsc_decode_row(&br, row, y ? row - block->width : NULL, block->width, block->bits);
+	}
+	if (out != block->plane)
+	{
+		memcpy(block->plane, out + (size_t)block->skip*block->width,
+				(size_t)block->keep*block->width*sizeof(uint16_t));
+		free(out);
+	}
+}
+
+// Build the header of a compressed channel plane file
+void lsc_header(const struct raw_image *img, unsigned int black_level, uint8_t *hdr)
+{
+	memset(hdr, 0, LSC_HEADER_SIZE);
+	memcpy(hdr, "LSCP", 4);
+	put_le16(hdr + 4, 1);			//Version
+	hdr[6] = img->bayer_order;
+	hdr[7] = sample_bits(img->max_val);
+	put_le32(hdr + 8, img->width / 2);
+	put_le32(hdr + 12, img->height / 2);
+	put_le16(hdr + 16, img->max_val);
+	put_le16(hdr + 18, black_level);	//Already subtracted from the samples
+	put_le16(hdr + 20, img->transform);
+	put_le16(hdr + 22, LSC_BLOCK_ROWS);
+	memcpy(hdr + 24, img->model, 31);
+}
+
+// Compress rows 0 to rows-1 of the four channel planes, in blocks across the
+// worker threads, and append them to fd. Each block is preceded by its size.
+int lsc_write_strip(int fd, uint16_t *const channel[], int width, int rows, int bits, int num_threads)
+{
+	int bands = (rows + LSC_BLOCK_ROWS - 1) / LSC_BLOCK_ROWS;
+	int num_blocks = bands * NUM_CHANNELS;
+	size_t bound = lsc_block_bound(width, LSC_BLOCK_ROWS, bits);
+	struct lsc_block *blocks;
+	struct iovec *iov;
+	uint8_t *sizes, *bufs;
+	int i, ret = -1;
+
+	blocks = (struct lsc_block *)calloc(num_blocks, sizeof(struct lsc_block));
+	iov = (struct iovec *)malloc(num_blocks * 2 * sizeof(struct iovec));
+	sizes = (uint8_t *)malloc(num_blocks * 4);
+	bufs = (uint8_t *)malloc(num_blocks * bound);
+	if (blocks && iov && sizes && bufs)
+	{
+		for (i=0; i<num_blocks; i++)
+		{
+			int band = i / NUM_CHANNELS;
+			blocks[i].plane = channel[i % NUM_CHANNELS] + (size_t)band*LSC_BLOCK_ROWS*width;
+			blocks[i].width = width;
+			blocks[i].rows = min_int(LSC_BLOCK_ROWS, rows - band*LSC_BLOCK_ROWS);
+			blocks[i].bits = bits;
+			blocks[i].buf = bufs + (size_t)i*bound;
+		}
+		run_jobs(lsc_encode_block, blocks, sizeof(struct lsc_block), num_blocks, num_threads);
+
+		for (i=0; i<num_blocks; i++)
+		{
+			put_le32(sizes + i*4, blocks[i].size);
+			iov[i*2].iov_base = sizes + i*4;
+			iov[i*2].iov_len = 4;
+			iov[i*2+1].iov_base = blocks[i].buf;
+			iov[i*2+1].iov_len = blocks[i].size;
+		}
+		ret = writev_all(fd, iov, num_blocks * 2);
+	}
+	free(blocks);
+	free(iov);
+	free(sizes);
+	free(bufs);
+	return ret;
+}
+
+//Compressed channel planes, read back as the input
+struct lsc_file {
+	int width;		//Of each channel plane
+	int height;
+	int bits;
+	int block_rows;
+	const uint8_t **block;	//Coded data of each block, in band then channel order
+	size_t *block_size;
+};
+
+// Parse a compressed channel plane file written with --plane-format lsc,
+// and find each of the blocks
+int parse_lsc(const uint8_t *buf, size_t size, struct raw_image *img, struct lsc_file *lsc)
+{
+	size_t offset = LSC_HEADER_SIZE;
+	int i, num_blocks;
+
+	if (size < LSC_HEADER_SIZE || memcmp(buf, "LSCP", 4) || get_le16(buf + 4) != 1)
+	{
+		printf("Not a compressed channel plane file\n");
+		return -1;
+	}
+	lsc->width = get_le32(buf + 8);
+	lsc->height = get_le32(buf + 12);
+	lsc->bits = buf[7];
+	lsc->block_rows = get_le16(buf + 22);
+	if (lsc->width <= 0 || lsc->height <= 0 || lsc->bits > 16 || !lsc->block_rows || buf[6] > 3)
+	{
+		printf("Invalid compressed channel plane header\n");
+		return -1;
+	}
+
+	num_blocks = (lsc->height + lsc->block_rows - 1) / lsc->block_rows * NUM_CHANNELS;
+	lsc->block = (const uint8_t **)malloc(num_blocks * sizeof(uint8_t *));
+	lsc->block_size = (size_t *)malloc(num_blocks * sizeof(size_t));
+	if (!lsc->block || !lsc->block_size)
+	{
+		printf("Not enough memory to read the compressed channel planes\n");
+		free(lsc->block);
+		free(lsc->block_size);
+		lsc->block = NULL;
+		return -1;
+	}
+	for (i=0; i<num_blocks; i++)
+	{
+		if (offset + 4 > size || get_le32(buf + offset) > size - offset - 4)
+		{
+			printf("Compressed channel plane file is truncated\n");
+			free(lsc->block);
+			free(lsc->block_size);
+			lsc->block = NULL;
+			return -1;
+		}
+		lsc->block_size[i] = get_le32(buf + offset);
+		lsc->block[i] = buf + offset + 4;
+		offset += 4 + lsc->block_size[i];
+	}
+
+	img->data = NULL;
+	img->stride = 0;
+	img->width = lsc->width * 2;
+	img->height = lsc->height * 2;
+	img->packing = PACKING_RAW16;
+	img->bayer_order = buf[6];
+	img->max_val = get_le16(buf + 16);
+	img->black_level = get_le16(buf + 18);
+	img->transform = get_le16(buf + 20);
+	memcpy(img->model, buf + 24, 31);
+	img->model[31] = '\0';
+	printf("Compressed channel planes, %d x %d per channel\n", lsc->width, lsc->height);
+	return 0;
+}
+
+// Decode rows y0 to y1-1 of the four channel planes, with row y0 going
+// to the start of channel[], across the worker threads
+void lsc_read_rows(const struct lsc_file *lsc, uint16_t *const channel[], int y0, int y1, int num_threads)
+{
+	int first_band = y0 / lsc->block_rows;
+	int bands = (y1 - 1) / lsc->block_rows - first_band + 1;
+	struct lsc_block *blocks;
+	int i;
+
+	blocks = (struct lsc_block *)calloc(bands * NUM_CHANNELS, sizeof(struct lsc_block));
+	if (!blocks)
+		return;
+	for (i=0; i<bands*NUM_CHANNELS; i++)
+	{
+		int band = first_band + i / NUM_CHANNELS;
+		int band_y = band * lsc->block_rows;
+		int start = max_int(band_y, y0);
+		int end = min_int(band_y + lsc->block_rows, y1);
+
+		blocks[i].plane = channel[i % NUM_CHANNELS] + (size_t)(start - y0)*lsc->width;
+		blocks[i].width = lsc->width;
+		blocks[i].rows = min_int(lsc->block_rows, lsc->height - band_y);
+		blocks[i].bits = lsc->bits;
+		blocks[i].buf = (uint8_t *)lsc->block[band*NUM_CHANNELS + i%NUM_CHANNELS];
+		blocks[i].size = lsc->block_size[band*NUM_CHANNELS + i%NUM_CHANNELS];
+		blocks[i].skip = start - band_y;
+		blocks[i].keep = end - start;
+	}
+	run_jobs(lsc_decode_block, blocks, sizeof(struct lsc_block), bands * NUM_CHANNELS, num_threads);
+	free(blocks);
+}
+
+//First line of the sidecar file describing saved channel planes
+#define PLANE_SIDECAR_ID "lens_shading_analyse channel planes"
+
+// Write the sidecar file describing the channel planes written with -o 8,
+// so that they can be read back with -i for re-analysis
+int write_plane_sidecar(const char *filename, const struct raw_image *img, unsigned int black_level,
+		enum plane_format_t format)
+{
+	const char *const *names = plane_filenames[format];
+	uint8_t hdr[PLANE_HEADER_MAX];
+	FILE *f = fopen(filename, "wb");
+
+	if (!f)
+	{
+		printf("Failed to write %s\n", filename);
+		return -1;
+	}
+	fprintf(f, "%s\n", PLANE_SIDECAR_ID);
+	fprintf(f, "width %d\n", img->width / 2);
+	fprintf(f, "height %d\n", img->height / 2);
+	fprintf(f, "bayer_order %d\n", img->bayer_order);
+	fprintf(f, "max_val %u\n", img->max_val);
+	fprintf(f, "black_level %u\n", black_level);
+	fprintf(f, "transform %u\n", img->transform);
+	fprintf(f, "model %s\n", img->model);
+	fprintf(f, "files %s %s %s %s\n", names[0], names[1], names[2], names[3]);
+	fprintf(f, "offset %zu\n", plane_header(format, img->width / 2, img->height / 2, img->max_val, hdr));
+	fprintf(f, "big_endian %d\n", format == PLANE_PGM);
+	fclose(f);
+	return 0;
+}
+
+//Channel planes saved with -o 8, read back as the input
+struct plane_files {
+	int width;
+	int height;
+	size_t offset;		//Of the samples in each file
+	int big_endian;
+	uint8_t *map[NUM_CHANNELS];
+	size_t map_size[NUM_CHANNELS];
+	dev_t dev[NUM_CHANNELS];	//To spot outputs that would overwrite them
+	ino_t ino[NUM_CHANNELS];
+};
+
+// Parse the sidecar file of saved channel planes, and map the plane files,
+// which are looked for in the same directory as the sidecar
+int parse_plane_sidecar(const char *buf, size_t size, const char *sidecar_name,
+		struct raw_image *img, struct plane_files *planes)
+{
+	char text[1024], files[NUM_CHANNELS][256];
+	const char *slash = strrchr(sidecar_name, '/');
+	int dir_len = slash ? slash - sidecar_name + 1 : 0;
+	unsigned int bayer_order = 4, max_val = 0, black_level = 0, transform = 0;
+	char *line;
+	int i;
+
+	//Copy so that the text is terminated
+	size = size < sizeof(text) - 1 ? size : sizeof(text) - 1;
+	memcpy(text, buf, size);
+	text[size] = '\0';
+
+	planes->width = planes->height = 0;
+	planes->offset = 0;
+	planes->big_endian = 0;
+	files[0][0] = '\0';
+	img->model[0] = '\0';
+	for (line = strtok(text, "\n"); line; line = strtok(NULL, "\n"))
+	{
+		sscanf(line, "width %d", &planes->width);
+		sscanf(line, "height %d", &planes->height);
+		sscanf(line, "bayer_order %u", &bayer_order);
+		sscanf(line, "max_val %u", &max_val);
+		sscanf(line, "black_level %u", &black_level);
+		sscanf(line, "transform %u", &transform);
+		sscanf(line, "model %31s", img->model);
+		sscanf(line, "files %255s %255s %255s %255s", files[0], files[1], files[2], files[3]);
+		sscanf(line, "offset %zu", &planes->offset);
+		sscanf(line, "big_endian %d", &planes->big_endian);
+	}
+	if (planes->width <= 0 || planes->height <= 0 || bayer_order > 3 ||
+		max_val == 0 || max_val > 0xFFFF || !files[0][0])
+	{
+		printf("Incomplete channel plane description\n");
+		return -1;
+	}
+
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		char path[PATH_MAX];
+		struct stat plane_sb;
+		int fd;
+
+		snprintf(path, sizeof(path), "%.*s%s", dir_len, sidecar_name, files[i]);
+		fd = open(path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &plane_sb) ||
+			(size_t)plane_sb.st_size < planes->offset + (size_t)planes->width*planes->height*2)
+		{
+			printf("Failed to open channel plane %s, or it is too small\n", path);
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		planes->dev[i] = plane_sb.st_dev;
+		planes->ino[i] = plane_sb.st_ino;
+		planes->map_size[i] = plane_sb.st_size;
+		planes->map[i] = (uint8_t *)mmap(NULL, plane_sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (planes->map[i] == MAP_FAILED)
+		{
+			printf("mmap of %s failed\n", path);
+			planes->map[i] = NULL;
+			return -1;
+		}
+	}
+
+	img->data = NULL;
+	img->stride = 0;
+	img->width = planes->width * 2;
+	img->height = planes->height * 2;
+	img->packing = PACKING_RAW16;
+	img->bayer_order = bayer_order;
+	img->max_val = max_val;
+	img->black_level = black_level;
+	img->transform = transform;
+	printf("Channel planes, %d x %d per channel\n", planes->width, planes->height);
+	return 0;
+}
+
+// Check whether any of the files named would overwrite the input planes
+int plane_files_clash(const struct plane_files *planes, const char *const *filenames)
+{
+	struct stat out_sb;
+	int i, j;
+
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		if (stat(filenames[i], &out_sb))
+			continue;
+		for (j=0; j<NUM_CHANNELS; j++)
+		{
+			if (planes->map[j] && out_sb.st_dev == planes->dev[j] && out_sb.st_ino == planes->ino[j])
+				return 1;
+		}
+	}
+	return 0;
+}
+
+//Most frames median combined into a master flat field or dark frame
+#define MASTER_FRAMES_MAX 64
+//Offset of the pixel data in a master frame DNG
+#define MASTER_DATA_OFFSET 512
+
+// Header of a master frame: a little endian DNG with a single IFD holding
+// the uncompressed 16 bit CFA image, which is read back without unpacking.
+void master_header(const struct raw_image *img, uint8_t *hdr)
+{
+	static const uint8_t patterns[4][4] = {
+		{ 0, 1, 1, 2 },	//RGGB
+		{ 1, 2, 0, 1 },	//GBRG
+		{ 2, 1, 1, 0 },	//BGGR
+		{ 1, 0, 2, 1 }	//GRBG
+	};
+	//Orientation for each transform, the inverse of parse_dng's mapping
+	static const uint16_t orientations[4] = { 1, 2, 4, 3 };
+	const uint8_t *cfa = patterns[img->bayer_order];
+	const uint32_t model_offset = 256, exposure_offset = 288;
+	const uint32_t entries[][4] = {
+		{ 254, 4, 1, 0 },			//NewSubFileType, main image
+		{ 256, 4, 1, img->width },		//ImageWidth
+		{ 257, 4, 1, img->height },		//ImageLength
+		{ 258, 3, 1, 16 },			//BitsPerSample
+		{ 259, 3, 1, 1 },			//Compression, none
+		{ 262, 3, 1, 32803 },			//PhotometricInterpretation, CFA
+		{ 272, 2, strlen(img->model)+1, model_offset },	//Model
+		{ 273, 4, 1, MASTER_DATA_OFFSET },	//StripOffsets
+		{ 274, 3, 1, orientations[img->transform & 3] },	//Orientation
+		{ 277, 3, 1, 1 },			//SamplesPerPixel
+		{ 278, 4, 1, img->height },		//RowsPerStrip
+		{ 279, 4, 1, (uint32_t)img->width*img->height*2 },	//StripByteCounts
+		{ 33421, 3, 2, 2 | (2 << 16) },		//CFARepeatPatternDim
+		{ 33422, 1, 4, cfa[0] | (cfa[1] << 8) | (cfa[2] << 16) | ((uint32_t)cfa[3] << 24) },	//CFAPattern
+		{ 33434, 5, 1, exposure_offset },	//ExposureTime
+		{ 50706, 1, 4, 0x00000401 },		//DNGVersion 1.4
+		{ 50714, 4, 1, img->black_level },	//BlackLevel
+		{ 50717, 4, 1, img->max_val }		//WhiteLevel
+	};
+	int num_entries = sizeof(entries) / sizeof(entries[0]);
+	int i;
+
+	memset(hdr, 0, MASTER_DATA_OFFSET);
+	memcpy(hdr, "II*\0", 4);
+	put_le32(hdr + 4, 8);
+	put_le16(hdr + 8, num_entries);
+	for (i=0; i<num_entries; i++)
+	{
+		uint8_t *entry = hdr + 10 + i*12;
+		put_le16(entry, entries[i][0]);
+		put_le16(entry + 2, entries[i][1]);
+		put_le32(entry + 4, entries[i][2]);
+		put_le32(entry + 8, entries[i][3]);
+	}
+	memcpy(hdr + model_offset, img->model, 31);
+	put_le32(hdr + exposure_offset, img->exposure_us);
+	put_le32(hdr + exposure_offset + 4, 1000000);
+}
+
+//A band of lines of a master frame, median combined from the same lines of
+//every input frame
+struct combine_job {
+	const struct raw_image *frames;
+	int num_frames;
+	int y0, y1;
+	uint8_t *out;		//Master frame pixel data
+	int failed;		//Set if the lines could not be combined
+};
+
+static void combine_lines(void *arg)
+{
+	struct combine_job *job = (struct combine_job *)arg;
+	const struct raw_image *img = &job->frames[0];
+	int width = img->width, half = img->width/2;
+	int n = job->num_frames;
+	uint16_t *lines = (uint16_t *)malloc((size_t)n*width*sizeof(uint16_t));
+	uint16_t vals[MASTER_FRAMES_MAX];
+	int f, i, x, y;
+
+	job->failed = !lines;
+	if (!lines)
+		return;
+	for (y=job->y0; y<job->y1; y++)
+	{
+		uint8_t *out = job->out + (size_t)y*width*2;
+
+		//Each frame's line unpacks to its even then odd pixels
+		for (f=0; f<n; f++)
+		{
+			const struct raw_image *frame = &job->frames[f];
+			unpackers[frame->packing](frame->data + (size_t)y*frame->stride, width,
+					lines + (size_t)f*width, lines + (size_t)f*width + half);
+		}
+		for (x=0; x<width; x++)
+		{
+			size_t pos = (x&1)*half + x/2;
+
+			//Insertion sort, as there are only a few frames
+			for (f=0; f<n; f++)
+			{
+				uint16_t v = lines[(size_t)f*width + pos];
+				for (i=f; i>0 && vals[i-1] > v; i--)
+					vals[i] = vals[i-1];
+				vals[i] = v;
+			}
+			put_le16(out + x*2, n & 1 ? vals[n/2] : (vals[n/2-1] + vals[n/2] + 1) / 2);
+		}
+	}
+	free(lines);
+}
+
+// Median combine the frames into a master frame DNG at filename. The output
+// is mapped and filled in bands of lines across the worker threads, so only
+// a few lines of each input are needed in memory at a time.
+int write_master(const char *filename, const struct raw_image *frames, int num_frames, int num_threads)
+{
+	const struct raw_image *img = &frames[0];
+	size_t size = MASTER_DATA_OFFSET + (size_t)img->width*img->height*2;
+	struct combine_job *jobs;
+	char tmp_name[PATH_MAX];
+	int num_jobs = (img->height + 15) / 16;
+	uint8_t *map;
+	int fd, i, failed = 0;
+
+	//Written under a temporary name, so a cache never holds a partial frame
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+	fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, size))
+	{
+		printf("Failed to write %s\n", filename);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		printf("mmap failed\n");
+		unlink(tmp_name);
+		return -1;
+	}
+
+	master_header(img, map);
+	jobs = (struct combine_job *)malloc(num_jobs * sizeof(struct combine_job));
+	if (!jobs)
+	{
+		printf("Not enough memory to combine %s\n", filename);
+		munmap(map, size);
+		unlink(tmp_name);
+		return -1;
+	}
+	for (i=0; i<num_jobs; i++)
+	{
+		jobs[i].frames = frames;
+		jobs[i].num_frames = num_frames;
+		jobs[i].y0 = i*16;
+		jobs[i].y1 = min_int(i*16 + 16, img->height);
+		jobs[i].out = map + MASTER_DATA_OFFSET;
+	}
+	run_jobs(combine_lines, jobs, sizeof(struct combine_job), num_jobs, num_threads);
+	for (i=0; i<num_jobs; i++)
+		failed |= jobs[i].failed;
+	free(jobs);
+	munmap(map, size);
+
+	if (failed)
+	{
+		printf("Not enough memory to combine %s\n", filename);
+		unlink(tmp_name);
+		return -1;
+	}
+	if (rename(tmp_name, filename))
+	{
+		printf("Failed to write %s\n", filename);
+		unlink(tmp_name);
+		return -1;
+	}
+	return 0;
+}
+
+// FNV-1a hash of size bytes of data, continued from hash
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	size_t i;
+
+	for (i=0; i<size; i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+// Median combine the raw files into a master frame of the given kind, "flat"
+// or "dark". With a cache directory the master is named by the sensor model,
+// mode, exposure and a hash of the input frames, and reused while it exists.
+// Otherwise it is written to master_<kind>.dng. The name of the master is
+// returned in path.
+
+int build_master(const char *const *names, int num_names, const struct raw_format *fmt,
+		const char *cache_dir, const char *kind, uint32_t exposure_us, int num_threads,
+		char *path, size_t path_len)
+{
+	struct raw_image frames[MASTER_FRAMES_MAX];
+	void *maps[MASTER_FRAMES_MAX];
+	size_t sizes[MASTER_FRAMES_MAX];
+	//Identifies the set of input frames in the cache key
+	uint64_t inputs = fnv1a(0xcbf29ce484222325ULL, &num_names, sizeof(num_names));
+	char real[PATH_MAX];
+	const char *name;
+	int64_t stamp[3];
+	struct stat sb;
+	int i, ret = -1, num_maps = 0;
+
+	for (i=0; i<num_names; i++)
+	{
+		int fd = open(names[i], O_RDONLY);
+		if (fd < 0 || fstat(fd, &sb))
+		{
+			printf("Failed to open %s\n", names[i]);
+			if (fd >= 0)
+				close(fd);
+			goto unmap;
+		}
+		sizes[i] = sb.st_size;
+		maps[i] = mmap(NULL, sizes[i], PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (maps[i] == MAP_FAILED)
+		{
+			printf("mmap failed\n");
+			goto unmap;
+		}
+		num_maps++;
+		name = realpath(names[i], real) ? real : names[i];
+		stamp[0] = sb.st_size;
+		stamp[1] = sb.st_mtim.tv_sec;
+		stamp[2] = sb.st_mtim.tv_nsec;
+		inputs = fnv1a(inputs, name, strlen(name) + 1);
+		inputs = fnv1a(inputs, stamp, sizeof(stamp));
+
+		printf("Reading %s frame %s\n", kind, names[i]);
+		if (parse_raw_file((uint8_t *)maps[i], sizes[i], fmt, &frames[i]))
+			goto unmap;
+		if (frames[i].width != frames[0].width || frames[i].height != frames[0].height ||
+				frames[i].bayer_order != frames[0].bayer_order || frames[i].max_val != frames[0].max_val)
+		{
+			printf("%s does not match %s\n", names[i], names[0]);
+			goto unmap;
+		}
+	}
+	if (exposure_us)
+		frames[0].exposure_us = exposure_us;
+
+	if (cache_dir)
+	{
+		char model[32];
+
+		//Keep the cache key usable as a file name
+		strcpy(model, frames[0].model[0] ? frames[0].model : "unknown");
+		for (i=0; model[i]; i++)
+		{
+			if (model[i] == '/' || model[i] == ' ')
+				model[i] = '_';
+		}
+		snprintf(path, path_len, "%s/%s_%dx%d_%dbit_%uus_%s_%016llx.dng", cache_dir, model,
+				frames[0].width, frames[0].height, sample_bits(frames[0].max_val),
+				frames[0].exposure_us, kind, (unsigned long long)inputs);
+		if (!stat(path, &sb))
+		{
+			printf("Using cached master %s frame %s\n", kind, path);
+			ret = 0;
+			goto unmap;
+		}
+	}
+	else
+		snprintf(path, path_len, "master_%s.dng", kind);
+
+	printf("Combining %d %s frames into %s\n", num_names, kind, path);
+	ret = write_master(path, frames, num_names, num_threads);
+unmap:
+	for (i=0; i<num_maps; i++)
+		munmap(maps[i], sizes[i]);
+	return ret;
+}
+
+// Evaluate the basis functions of the fit model at channel pixel (px, py).
+// Returns the number of terms, with their values in basis[]. For the spline
+// model only the 4x4 non-zero terms are returned, with their indices in idx[].
+int fit_basis(enum fit_model_t model, double px, double py, int width, int height,
+		int knots_x, int knots_y, double *basis, int *idx)
+{
+	if (model == FIT_RADIAL)
+	{
+		//Normalise so that r = 1 in the corners
+		double half_diag = sqrt((double)width*width + (double)height*height) / 2;
+		double u = (px - width/2.0) / half_diag;
+		double v = (py - height/2.0) / half_diag;
+		double r2 = u*u + v*v;
+		basis[0] = 1.0;
+		basis[1] = u;
+		basis[2] = v;
+		basis[3] = r2;
+		basis[4] = r2*r2;
+		basis[5] = r2*r2*r2;
+		for (int i=0; i<RADIAL_TERMS; i++)
+			idx[i] = i;
+		return RADIAL_TERMS;
+	}
+	else
+	{
+		//Uniform cubic B-spline, knots_-3 segments across the image
+		double bx[4], by[4];
+		double t[2] = { px * (knots_x-3) / width, py * (knots_y-3) / height };
+		int seg[2];
+		double *b[2] = { bx, by };
+		int n = 0;
+
+		for (int a=0; a<2; a++)
+		{
+			int segs = (a ? knots_y : knots_x) - 3;
+			seg[a] = (int)floor(t[a]);
+			if (seg[a] < 0)
+				seg[a] = 0;
+			else if (seg[a] >= segs)
+				seg[a] = segs-1;
+			double f = t[a] - seg[a];
+			double f2 = f*f, f3 = f2*f;
+			b[a][0] = (1 - 3*f + 3*f2 - f3) / 6;
+			b[a][1] = (4 - 6*f2 + 3*f3) / 6;
+			b[a][2] = (1 + 3*f + 3*f2 - 3*f3) / 6;
+			b[a][3] = f3 / 6;
+		}
+		for (int j=0; j<4; j++)
+		{
+			for (int i=0; i<4; i++)
+			{
+				basis[n] = bx[i] * by[j];
+				idx[n++] = (seg[1]+j)*knots_x + seg[0]+i;
+			}
+		}
+		return n;
+	}
+}
+
+// Solve the symmetric positive definite system a.x = b in place (b becomes x)
+// by Cholesky decomposition. Returns 0 on success.
+int cholesky_solve(double *a, double *b, int n)
+{
+	int i, j, k;
+
+	for (j=0; j<n; j++)
+	{
+		double d = a[j*n+j];
+		for (k=0; k<j; k++)
+			d -= a[j*n+k] * a[j*n+k];
+		if (d <= 0)
+			return -1;
+		d = sqrt(d);
+		a[j*n+j] = d;
+		for (i=j+1; i<n; i++)
+		{
+			double v = a[i*n+j];
+			for (k=0; k<j; k++)
+				v -= a[i*n+k] * a[j*n+k];
+			a[i*n+j] = v / d;
+		}
+	}
+	for (i=0; i<n; i++)
+	{
+		double v = b[i];
+		for (k=0; k<i; k++)
+			v -= a[i*n+k] * b[k];
+		b[i] = v / a[i*n+i];
+	}
+	for (i=n-1; i>=0; i--)
+	{
+		double v = b[i];
+		for (k=i+1; k<n; k++)
+			v -= a[k*n+i] * b[k];
+		b[i] = v / a[i*n+i];
+	}
+	return 0;
+}
+
+// Replace the block sums with a smooth surface fitted to them by weighted
+// least squares, each cell weighted by the number of pixels it was computed
+// from. Returns the new largest block sum, or 0 if the fit failed.
+uint32_t fit_block_sums(enum fit_model_t model, uint32_t *block_sum, const uint32_t *block_count,
+		int width, int height, uint32_t grid_width, uint32_t grid_height)
+{
+	double ata[FIT_TERMS_MAX*FIT_TERMS_MAX] = { 0 };
+	double atb[FIT_TERMS_MAX] = { 0 };
+	double basis[FIT_TERMS_MAX];
+	int idx[FIT_TERMS_MAX];
+	int knots_x = min_int(SPLINE_KNOTS_MAX, max_int(4, grid_width));
+	int knots_y = min_int(SPLINE_KNOTS_MAX, max_int(4, grid_height));
+	int terms = model == FIT_RADIAL ? RADIAL_TERMS : knots_x*knots_y;
+	uint32_t max_blk_val = 0;
+	double trace = 0;
+	int x, y, i, j, n;
+
+	// Accumulate the normal equations
+	for (y=0; y<grid_height; y++)
+	{
+		for (x=0; x<grid_width; x++)
+		{
+			uint32_t cell = y*grid_width + x;
+			double w = block_count[cell];
+			if (w == 0)
+				continue;
+			n = fit_basis(model, x*32+16, y*32+16, width, height, knots_x, knots_y, basis, idx);
+			for (i=0; i<n; i++)
+			{
+				for (j=0; j<n; j++)
+					ata[idx[i]*terms + idx[j]] += w * basis[i] * basis[j];
+				atb[idx[i]] += w * basis[i] * block_sum[cell];
+			}
+		}
+	}
+
+	// A little ridge regularisation keeps the spline solvable on small grids
+	for (i=0; i<terms; i++)
+		trace += ata[i*terms+i];
+	for (i=0; i<terms; i++)
+		ata[i*terms+i] += trace * 1e-9 / terms;
+
+	if (cholesky_solve(ata, atb, terms))
+		return 0;
+
+	// Resample the fitted surface at the grid cell centres
+	for (y=0; y<grid_height; y++)
+	{
+		for (x=0; x<grid_width; x++)
+		{
+			double v = 0;
+			n = fit_basis(model, x*32+16, y*32+16, width, height, knots_x, knots_y, basis, idx);
+			for (i=0; i<n; i++)
+				v += basis[i] * atb[idx[i]];
+			uint32_t block_val = v < 1.0 ? 1 : (uint32_t)(v + 0.5);
+			block_sum[y*grid_width + x] = block_val;
+			if (block_val > max_blk_val)
+				max_blk_val = block_val;
+		}
+	}
+	return max_blk_val;
+}
+
+// Parse a comma separated list of up to max numbers into values.
+// Returns the number of values, or -1 if there are too many.
+int parse_list(const char *str, unsigned int *values, int max)
+{
+	int n = 0;
+	char *end;
+
+	do
+	{
+		if (n == max)
+			return -1;
+		values[n++] = strtoul(str, &end, 10);
+		str = end + 1;
+	}
+	while (*end == ',');
+	return n;
+}
+
+// Parse a comma separated list of up to max estimator names.
+// Returns the number of estimators, or -1 if one is unknown or there are too many.
+int parse_estimators(const char *str, enum estimator_t *estimators, int max)
+{
+	int n = 0;
+
+	do
+	{
+		size_t len = strcspn(str, ",");
+		int i;
+
+		if (n == max)
+			return -1;
+		for (i=0; i<3; i++)
+		{
+			if (strlen(estimator_names[i]) == len && !strncmp(str, estimator_names[i], len))
+				break;
+		}
+		if (i == 3)
+			return -1;
+		estimators[n++] = i;
+		str += len;
+	}
+	while (*str++ == ',');
+	return n;
+}
+
+//One combination of analysis settings, as swept over by giving lists of them
+struct sweep_combo {
+	int block_size;
+	int black_idx;		//Into the list of black levels
+	unsigned int black_level;
+	enum estimator_t estimator;
+	block_sums_fn block_sums;
+	uint32_t *block_sum[NUM_CHANNELS];
+	uint32_t *block_count[NUM_CHANNELS];
+	uint32_t *dark_sum[NUM_CHANNELS];	//Of the dark frame, for --dark-mode cell
+	uint32_t *dark_count[NUM_CHANNELS];
+	struct cell_stats stats[NUM_CHANNELS];	//For -o 128
+	double stats_scale;	//From the values of the statistics to those of the block sums
+};
+
+//The block sums of one channel of a strip, for one combination of settings
+struct block_sums_job {
+	block_sums_fn block_sums;	//NULL for --lowpass
+	const uint16_t *channel;
+	const uint8_t *mask;
+	int width;
+	int height;
+	int y0;
+	int rows;
+	uint32_t grid_width;
+	int block_size;
+	uint32_t *block_sum;
+	uint32_t *block_count;
+	const struct cell_stats *stats;	//NULL unless asked for
+};
+
+static void run_block_sums(void *arg)
+{
+	struct block_sums_job *job = (struct block_sums_job *)arg;
+
+	if (job->block_sums)
+		job->block_sums(job->channel, job->mask, job->width, job->height, job->y0,
+				job->grid_width, job->y0/32, (job->y0+job->rows+31)/32,
+				job->block_size, job->block_sum, job->block_count, job->stats);
+	else
+		accumulate_cell_sums(job->channel, job->mask, job->width, job->y0, job->rows,
+				job->grid_width, job->block_sum, job->block_count, job->stats);
+}
+
+//The unpacking of one strip of a raw image into the channel buffers
+struct decode_job {
+	const struct raw_image *img;
+	const uint16_t *black_lut;	//NULL to keep the raw values
+	uint16_t *channel[NUM_CHANNELS];	//Line strip_y of each channel
+	int strip_y;
+	int rows;
+	int first, last;		//Lines to decode, including the halo
+};
+
+static void run_decode(void *arg)
+{
+	struct decode_job *job = (struct decode_job *)arg;
+	const struct raw_image *img = job->img;
+	unpack_fn unpack = unpackers[img->packing];
+	int width = img->width/2;
+	int y;
+
+	for (y=job->first*2; y<job->last*2; y++)
+	{
+		const uint8_t *line = img->data + (size_t)y*img->stride;
+		ptrdiff_t offset = (ptrdiff_t)((y>>1)-job->strip_y)*width;
+		int chan_a = (y&1) ? 2 : 0;
+
+		unpack(line, img->width, job->channel[chan_a] + offset, job->channel[chan_a+1] + offset);
+		if (job->black_lut)
+		{
+			apply_black_lut(job->channel[chan_a] + offset, job->channel[chan_a] + offset, width, job->black_lut);
+			apply_black_lut(job->channel[chan_a+1] + offset, job->channel[chan_a+1] + offset, width, job->black_lut);
+		}
+	}
+}
+
+struct dark_level_job {
+	const struct raw_image *img;
+	int y0, y1;		//Lines to total
+	uint64_t total;
+};
+
+static void run_dark_level(void *arg)
+{
+	struct dark_level_job *job = (struct dark_level_job *)arg;
+	const struct raw_image *img = job->img;
+	unpack_fn unpack = unpackers[img->packing];
+	int width = img->width/2;
+	uint16_t *line = (uint16_t *)malloc((size_t)img->width * sizeof(uint16_t));
+	int x, y;
+
+	job->total = 0;
+	if (!line)
+		return;
+	for (y=job->y0; y<job->y1; y++)
+	{
+		unpack(img->data + (size_t)y*img->stride, img->width, line, line + width);
+		for (x=0; x<img->width; x++)
+			job->total += line[x];
+	}
+	free(line);
+}
+
+// The mean of all the pixels of a dark frame, which stands as its black
+// level. It is measured before the analysis so that the defect noise floor
+// and the clipping limits are judged against it.
+unsigned int measure_dark_level(const struct raw_image *img, int num_threads)
+{
+	struct dark_level_job jobs[MAX_THREADS];
+	uint64_t total = 0, pixels = (uint64_t)img->width*img->height;
+	int i, num_jobs = min_int(max_int(num_threads, 1), MAX_THREADS);
+
+	for (i=0; i<num_jobs; i++)
+	{
+		jobs[i].img = img;
+		jobs[i].y0 = img->height * i / num_jobs;
+		jobs[i].y1 = img->height * (i+1) / num_jobs;
+	}
+	run_jobs(run_dark_level, jobs, sizeof(struct dark_level_job), num_jobs, num_threads);
+	for (i=0; i<num_jobs; i++)
+		total += jobs[i].total;
+	return (total + pixels/2) / pixels;
+}
+
+// Subtract a dark frame from the flat field pixel by pixel, clamping at zero
+void subtract_dark(const uint16_t *src, const uint16_t *dark, uint16_t *dst, size_t count)
+{
+	size_t i;
+
+	for (i=0; i<count; i++)
+		dst[i] = src[i] > dark[i] ? src[i] - dark[i] : 0;
+}
+
+// Subtract the block sums of a dark frame, made with the same settings, from
+// those of the flat field, then rescale to the white level above the mean
+// dark level as black_correct_block_sums does.
+void dark_correct_block_sums(uint32_t *block_sum, const uint32_t *dark_sum, size_t cells,
+		unsigned int dark_level, unsigned int max_val)
+{
+	size_t i;
+
+	for (i=0; i<cells; i++)
+	{
+		uint64_t block_val = block_sum[i] > dark_sum[i] ?
+				(uint64_t)(block_sum[i] - dark_sum[i]) * max_val / (max_val - dark_level) : 0;
+		if (block_val > UINT32_MAX)
+			block_val = UINT32_MAX;
+		block_sum[i] = block_val ? block_val : 1;
+	}
+}
+
+// Fixed point gains to bring each cell's value up to max_blk_val, rounded to
+// nearest and limited to between 1 and the largest the format holds. The
+// grid is taken in chunks, with the division in doubles and the clipping in
+// integers as separate branch free passes, so that both vectorise. The
+// cells limited either way are added to clamps.
+void sums_to_gains(const uint32_t *block_sum, size_t cells, uint32_t max_blk_val,
+		const struct gain_format *gf, uint16_t *gains, struct gain_clamps *clamps)
+{
+	double scale = (double)max_blk_val * (1 << gf->frac_bits);
+	int unity = 1 << gf->frac_bits;
+	int max_gain = (1 << (gf->int_bits + gf->frac_bits)) - 1;
+	unsigned int clipped = 0, floored = 0;
+	int32_t rounded[64];
+	size_t i, j;
+
+	for (i=0; i<cells; i+=64)
+	{
+		size_t n = cells - i < 64 ? cells - i : 64;
+
+		for (j=0; j<n; j++)
+		{
+			//Converted in 16 bit halves, as SIMD only converts signed integers
+			uint32_t val = block_sum[i+j];
+			double sum = (int)(val >> 16) * 65536.0 + (int)(val & 0xFFFF);
+			double gain = scale / sum + 0.5;
+			rounded[j] = gain < max_gain + 1 ? gain : max_gain + 1;
+		}
+		for (j=0; j<n; j++)
+		{
+			int gain = rounded[j];
+			clipped += gain > max_gain;
+			floored += gain < unity;
+			gain = gain < max_gain ? gain : max_gain;
+			gains[i+j] = gain > unity ? gain : unity;	//Cells above the reference level stay at x1.0
+		}
+	}
+	clamps->clipped += clipped;
+	clamps->floored += floored;
+}
+
+// Level of a channel's block sums that its gains are normalised to
+uint32_t reference_level(const uint32_t *block_sum, uint32_t grid_width, uint32_t grid_height,
+		int block_size, const struct normalisation *norm)
+{
+	size_t cells = (size_t)grid_width*grid_height;
+	uint64_t total = 0;
+	uint32_t x, y, n = 0;
+
+	switch (norm->mode) {
+	case NORM_PERCENTILE:
+	{
+		uint32_t *sorted = (uint32_t *)malloc(cells * sizeof(uint32_t));
+		uint32_t level;
+
+		if (!sorted)
+		{
+			printf("Not enough memory for the percentile level, normalising to the maximum\n");
+			return max_block_sum(block_sum, cells);
+		}
+		memcpy(sorted, block_sum, cells * sizeof(uint32_t));
+		qsort(sorted, cells, sizeof(uint32_t), compare_uint32);
+		level = sorted[(size_t)(norm->value / 100 * (cells - 1) + 0.5)];
+		free(sorted);
+		return level;
+	}
+	case NORM_CENTRE:
+		//The middle one or two cells each way
+		for (y=(grid_height-1)/2; y<=grid_height/2; y++)
+		{
+			for (x=(grid_width-1)/2; x<=grid_width/2; x++, n++)
+				total += block_sum[y*grid_width + x];
+		}
+		return (total + n/2) / n;
+	case NORM_FIXED:
+		//Block sums are of block_size*block_size pixels
+		return norm->value * block_size * block_size + 0.5;
+	default:
+		return max_block_sum(block_sum, cells);
+	}
+}
+
+// Work out the gains of the grid cells of one channel from its block sums,
+// in the gain format, normalised as asked. The cells whose gains were
+// limited are added to clamps.
+void compute_gains(const uint32_t *block_sum, uint32_t grid_width, uint32_t grid_height, int block_size,
+		const struct normalisation *norm, const struct gain_format *gf, uint16_t *gains,
+		struct gain_clamps *clamps)
+{
+	size_t i, cells = (size_t)grid_width*grid_height;
+	uint32_t level, min_sum = UINT32_MAX;
+
+	level = reference_level(block_sum, grid_width, grid_height, block_size, norm);
+	if (norm->no_clip)
+	{
+		//The largest level at which the darkest cell's gain still rounds
+		//to no more than the maximum
+		double max_gain = (1 << (gf->int_bits + gf->frac_bits)) - 1;
+		double limit;
+
+		for (i=0; i<cells; i++)
+			min_sum = block_sum[i] < min_sum ? block_sum[i] : min_sum;
+		limit = (max_gain + 0.5) * min_sum / (1 << gf->frac_bits);
+		if (level >= limit)
+			level = ceil(limit) - 1;
+	}
+	sums_to_gains(block_sum, cells, level, gf, gains, clamps);
+}
+
+// Write out the lens shading tables selected by out_frmt, with suffix added
+// to the file names. gains holds the gains of each channel in the order
+// RGGB, and ordering the channel plane each came from.
+void write_tables(const char *suffix, uint8_t out_frmt, uint16_t *const gains[NUM_CHANNELS],
+		const int *ordering, uint32_t grid_width, uint32_t grid_height, uint32_t transform,
+		const struct gain_format *gf)
+{
+	int wide = gf->int_bits + gf->frac_bits > 8;
+	const char *channel_comments[4] = {
+		"R",
+		"Gr",
+		"Gb",
+		"B"
+	};
+	struct text_file *header = NULL, *table = NULL;
+	FILE *bin = NULL;
+	char filename[64];
+	uint32_t x, y;
+	int i;
+
+	if (out_frmt&0x01)
+	{
+		snprintf(filename, sizeof(filename), "ls_table%s.h", suffix);
+		header = text_open(filename);
+	}
+	if (out_frmt&0x02)
+	{
+		snprintf(filename, sizeof(filename), "ls%s.bin", suffix);
+		bin = fopen(filename, "wb");
+	}
+	if (out_frmt&0x04)
+	{
+		snprintf(filename, sizeof(filename), "ls_table%s.txt", suffix);
+		table = text_open(filename);
+	}
+	if (header)
+	{
+		text_str(header, wide ? "uint16_t ls_grid[] = {\n" : "uint8_t ls_grid[] = {\n");
+	}
+	if (bin)
+	{
+		fwrite(&transform, sizeof(uint32_t), 1, bin);
+		fwrite(&grid_width, sizeof(uint32_t), 1, bin);
+		fwrite(&grid_height, sizeof(uint32_t), 1, bin);
+	}
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		const uint16_t *gain = gains[i];
+
+		if (header)
+		{
+			text_str(header, "//");
+			text_str(header, channel_comments[i]);
+			text_str(header, " - Ch ");
+			text_uint(header, ordering[i], "\n");
+		}
+		for (y=0; y<grid_height; y++)
+		{
+			for (x=0; x<grid_width; x++)
+			{
+				if (header)
+				{
+					text_uint(header, *gain, ", ");
+				}
+				if (bin)
+				{
+					//Wide gains are 16 bit little endian
+					uint8_t val[2] = { *gain & 0xFF, *gain >> 8 };
+					fwrite(val, wide ? 2 : 1, 1, bin);
+				}
+				if (table)
+				{
+					text_uint(table, x * 32 + 16, " ");
+					text_uint(table, y * 32 + 16, " ");
+					text_uint(table, *gain, " ");
+					text_uint(table, i, "\n");
+				}
+				gain++;
+			}
+		}
+	}
+	if (header)
+	{
+		text_str(header, "};\n");
+		text_str(header, "uint32_t ref_transform = ");
+		text_uint(header, transform, ";\n");
+		text_str(header, "uint32_t grid_width = ");
+		text_uint(header, grid_width, ";\n");
+		text_str(header, "uint32_t grid_height = ");
+		text_uint(header, grid_height, ";\n");
+		if (gf->int_bits != 3 || gf->frac_bits != 5)
+		{
+			text_str(header, "uint32_t gain_frac_bits = ");
+			text_uint(header, gf->frac_bits, ";\n");
+		}
+		if (text_close(header))
+			printf("Failed to write ls_table%s.h\n", suffix);
+	}
+	if (bin)
+		fclose(bin);
+	if (table && text_close(table))
+		printf("Failed to write ls_table%s.txt\n", suffix);
+}
+
+//Fractional bits of the colour ratios written with -o 32
+#define COLOUR_RATIO_BITS 12
+
+// The R/G and B/G ratios of each cell, in units of 1/(1 << COLOUR_RATIO_BITS),
+// and the green level, from the block sums of R, Gr, Gb and B in that order
+void colour_ratios(const uint32_t *const sums[NUM_CHANNELS], size_t cells,
+		uint32_t *green, uint16_t *cr, uint16_t *cb)
+{
+	const uint32_t *r = sums[0], *gr = sums[1], *gb = sums[2], *b = sums[3];
+	size_t i;
+
+	//Separate passes over the grid, each simple enough to vectorise
+	for (i=0; i<cells; i++)
+		green[i] = ((uint64_t)gr[i] + gb[i] + 1) >> 1;
+	for (i=0; i<cells; i++)
+	{
+		uint64_t ratio = (((uint64_t)r[i] << COLOUR_RATIO_BITS) + green[i]/2) / green[i];
+		cr[i] = ratio > UINT16_MAX ? UINT16_MAX : ratio;
+	}
+	for (i=0; i<cells; i++)
+	{
+		uint64_t ratio = (((uint64_t)b[i] << COLOUR_RATIO_BITS) + green[i]/2) / green[i];
+		cb[i] = ratio > UINT16_MAX ? UINT16_MAX : ratio;
+	}
+}
+
+// Write the colour shading separately from the luminance shading, as
+// ls_colour<suffix>.h and .txt. The luminance table holds the gains of the
+// green channels, and the Cr and Cb tables the further gains that flatten
+// the R/G and B/G ratios, all in ls_grid form. The ratios themselves are
+// written too, so the colour correction can be tuned without the raw.
+void write_colour_tables(const char *suffix, const uint32_t *const sums[NUM_CHANNELS],
+		uint32_t grid_width, uint32_t grid_height, uint32_t transform, const struct gain_format *gf)
+{
+	size_t i, cells = (size_t)grid_width*grid_height;
+	uint32_t *green = (uint32_t *)malloc(cells * sizeof(uint32_t));
+	uint32_t *ratio[2];
+	uint16_t *cr = (uint16_t *)malloc(cells * sizeof(uint16_t));
+	uint16_t *cb = (uint16_t *)malloc(cells * sizeof(uint16_t));
+	uint16_t *gains[3];
+	const char *names[3] = { "luma", "cr", "cb" };
+	struct gain_clamps clamps = { 0, 0 };
+	char filename[64];
+	struct text_file *header, *table;
+	int j;
+
+	colour_ratios(sums, cells, green, cr, cb);
+	for (j=0; j<3; j++)
+		gains[j] = (uint16_t *)malloc(cells * sizeof(uint16_t));
+	for (j=0; j<2; j++)
+		ratio[j] = (uint32_t *)malloc(cells * sizeof(uint32_t));
+	for (i=0; i<cells; i++)
+	{
+		ratio[0][i] = cr[i] ? cr[i] : 1;
+		ratio[1][i] = cb[i] ? cb[i] : 1;
+	}
+	sums_to_gains(green, cells, max_block_sum(green, cells), gf, gains[0], &clamps);
+	for (j=0; j<2; j++)
+		sums_to_gains(ratio[j], cells, max_block_sum(ratio[j], cells), gf, gains[j+1], &clamps);
+	if (clamps.clipped)
+		printf("Colour shading gains clipped in %u cells\n", clamps.clipped);
+	if (clamps.floored)
+		printf("Colour shading gains held at unity in %u cells\n", clamps.floored);
+
+	snprintf(filename, sizeof(filename), "ls_colour%s.h", suffix);
+	header = text_open(filename);
+	if (header)
+	{
+		for (j=0; j<3; j++)
+		{
+			text_printf(header, "%s ls_%s_grid[] = {\n",
+					gf->int_bits + gf->frac_bits > 8 ? "uint16_t" : "uint8_t", names[j]);
+			for (i=0; i<cells; i++)
+				text_uint(header, gains[j][i], ", ");
+			text_str(header, "\n};\n");
+		}
+		for (j=0; j<2; j++)
+		{
+			const uint16_t *r = j ? cb : cr;
+			text_printf(header, "//%s/G in units of 1/%d\n", j ? "B" : "R", 1 << COLOUR_RATIO_BITS);
+			text_printf(header, "uint16_t ls_%s_ratio[] = {\n", names[j+1]);
+			for (i=0; i<cells; i++)
+				text_uint(header, r[i], ", ");
+			text_str(header, "\n};\n");
+		}
+		text_printf(header, "uint32_t colour_ref_transform = %u;\n", transform);
+		text_printf(header, "uint32_t colour_grid_width = %u;\n", grid_width);
+		text_printf(header, "uint32_t colour_grid_height = %u;\n", grid_height);
+		if (text_close(header))
+			printf("Failed to write %s\n", filename);
+	}
+
+	snprintf(filename, sizeof(filename), "ls_colour%s.txt", suffix);
+	table = text_open(filename);
+	if (table)
+	{
+		text_str(table, "# x y luma_gain r/g b/g\n");
+		for (i=0; i<cells; i++)
+		{
+			text_uint(table, (uint32_t)(i % grid_width) * 32 + 16, " ");
+			text_uint(table, (uint32_t)(i / grid_width) * 32 + 16, " ");
+			text_fixed(table, gains[0][i] / (double)(1 << gf->frac_bits), 4, " ");
+			text_fixed(table, cr[i] / (double)(1 << COLOUR_RATIO_BITS), 4, " ");
+			text_fixed(table, cb[i] / (double)(1 << COLOUR_RATIO_BITS), 4, "\n");
+		}
+		if (text_close(table))
+			printf("Failed to write %s\n", filename);
+	}
+
+	for (j=0; j<3; j++)
+		free(gains[j]);
+	for (j=0; j<2; j++)
+		free(ratio[j]);
+	free(green);
+	free(cr);
+	free(cb);
+}
+
+// Add the line for one combination of settings to the sweep report: the mean
+// step in gain between neighbouring cells as a measure of smoothness, and
+// the range of the gains, over all the channels
+void report_sweep(FILE *report, const struct sweep_combo *combo, unsigned int black_level,
+		uint16_t *const gains[NUM_CHANNELS], uint32_t grid_width, uint32_t grid_height,
+		const struct gain_format *gf)
+{
+	double unity = 1 << gf->frac_bits;
+	uint64_t steps = 0, num_steps = 0;
+	int min_gain = INT_MAX, max_gain = 0;
+	uint32_t x, y;
+	int i;
+
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		for (y=0; y<grid_height; y++)
+		{
+			const uint16_t *row = gains[i] + (size_t)y*grid_width;
+			for (x=0; x<grid_width; x++)
+			{
+				if (x+1 < grid_width)
+					steps += abs(row[x+1] - row[x]);
+				if (y+1 < grid_height)
+					steps += abs(row[x+grid_width] - row[x]);
+				min_gain = min_int(min_gain, row[x]);
+				max_gain = max_int(max_gain, row[x]);
+			}
+		}
+		num_steps += (uint64_t)(grid_width-1)*grid_height + (uint64_t)grid_width*(grid_height-1);
+	}
+	fprintf(report, "%d %u %s %.4f %.3f %.3f\n", combo->block_size, black_level,
+			estimator_names[combo->estimator], num_steps ? steps / unity / num_steps : 0.0,
+			min_gain / unity, max_gain / unity);
+}
+
+//What to do about a flat field exposed out of range
+enum exposure_check_t {
+	EXPOSURE_OFF,
+	EXPOSURE_WARN,
+	EXPOSURE_ABORT,
+};
+
+struct exposure_limits {
+	enum exposure_check_t check;
+	double min_median, max_median;	//Percent of the range above black, of the brightest channel
+	double max_clipped;		//Percent of the pixels of any channel
+};
+
+// Judge the exposure of a raw image from a histogram of each channel of a
+// few evenly spaced line pairs, before the full decode. Returns -1 if it is
+// out of the limits.
+int check_exposure(const struct raw_image *img, unsigned int black_level, const struct exposure_limits *limits)
+{
+	static const char *channel_names[NUM_CHANNELS] = { "R", "Gr", "Gb", "B" };
+	unpack_fn unpack = unpackers[img->packing];
+	size_t range = packing_range(img->packing);
+	unsigned int sat_level = img->max_val - img->max_val / SATURATION_MARGIN;
+	int width = img->width/2, pairs = img->height/2;
+	int samples = pairs < EXPOSURE_LINE_PAIRS ? pairs : EXPOSURE_LINE_PAIRS;
+	uint32_t *hist = (uint32_t *)calloc(range * NUM_CHANNELS, sizeof(uint32_t));
+	uint16_t *line = (uint16_t *)malloc((size_t)width * 2 * sizeof(uint16_t));
+	double max_median = 0, max_clipped = 0;
+	struct timespec start, stop;
+	int i, x, y, sampled, ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (sampled=0; sampled<samples; sampled++)
+	{
+		//The middle line pair of each of samples equal bands
+		y = (int)(((int64_t)sampled*2 + 1) * pairs / (samples*2));
+		for (i=0; i<NUM_CHANNELS; i+=2)
+		{
+			uint32_t *hist_a = hist + range*i, *hist_b = hist + range*(i+1);
+
+			unpack(img->data + (size_t)(y*2 + i/2)*img->stride, img->width, line, line + width);
+			for (x=0; x<width; x++)
+			{
+				hist_a[line[x]]++;
+				hist_b[line[width + x]]++;
+			}
+		}
+	}
+
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		//In the order RGGB
+		const uint32_t *h = hist + range*channel_ordering[img->bayer_order][i];
+		uint64_t total = 0, clipped = 0, below = 0;
+		size_t v, median = 0;
+		double level, clipped_pct;
+
+		for (v=0; v<range; v++)
+		{
+			total += h[v];
+			clipped += v >= sat_level ? h[v] : 0;
+		}
+		for (v=0; v<range && below*2 < total; v++)
+		{
+			below += h[v];
+			median = v;
+		}
+		level = median > black_level ? 100.0 * (median - black_level) / (img->max_val - black_level) : 0;
+		clipped_pct = total ? 100.0 * clipped / total : 0;
+
+		printf("Exposure of %s: median %.1f%% of the range, %.2f%% clipped\n", channel_names[i], level, clipped_pct);
+		max_median = level > max_median ? level : max_median;
+		max_clipped = clipped_pct > max_clipped ? clipped_pct : max_clipped;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	printf("Exposure checked from %d line pairs in %.2f ms\n", sampled,
+			((stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9) * 1000);
+
+	if (max_median < limits->min_median)
+	{
+		printf("Underexposed: the brightest channel's median is below %.1f%% of the range\n", limits->min_median);
+		ret = -1;
+	}
+	else if (max_median > limits->max_median)
+	{
+		printf("Overexposed: the brightest channel's median is above %.1f%% of the range\n", limits->max_median);
+		ret = -1;
+	}
+	if (max_clipped > limits->max_clipped)
+	{
+		printf("Overexposed: over %.2f%% of a channel is clipped\n", limits->max_clipped);
+		ret = -1;
+	}
+	free(hist);
+	free(line);
+	return ret;
+}
+
+//A binned or cropped sensor mode to resample the tables for. The crop is in
+//full resolution pixels, and is then binned.
+struct sensor_mode {
+	char name[32];
+	int crop_x, crop_y;
+	int crop_width, crop_height;	//0 for the whole image
+	int binning;
+};
+
+// Parse a sensor mode given as [<width>x<height>[+<x>+<y>]][:<binning>].
+// Returns 0 on success.
+int parse_sensor_mode(const char *str, struct sensor_mode *mode)
+{
+	int n = 0;
+
+	memset(mode, 0, sizeof(*mode));
+	mode->binning = 1;
+	if (*str != ':')
+	{
+		if (sscanf(str, "%dx%d%n", &mode->crop_width, &mode->crop_height, &n) != 2)
+			return -1;
+		str += n;
+		if (*str == '+')
+		{
+			if (sscanf(str, "+%d+%d%n", &mode->crop_x, &mode->crop_y, &n) != 2)
+				return -1;
+			str += n;
+		}
+	}
+	if (*str == ':')
+	{
+		if (sscanf(str, ":%d%n", &mode->binning, &n) != 1)
+			return -1;
+		str += n;
+	}
+	//Crops must keep the Bayer order, and binned sizes whole
+	if (*str || mode->binning < 1 || mode->binning > 4 || mode->crop_width < 0 || mode->crop_height < 0 ||
+			mode->crop_x < 0 || mode->crop_y < 0 || (mode->crop_x | mode->crop_y) & 1 ||
+			(mode->crop_width | mode->crop_height) % (2 * mode->binning))
+		return -1;
+	if (mode->crop_width)
+		snprintf(mode->name, sizeof(mode->name), "%dx%d", mode->crop_width / mode->binning,
+				mode->crop_height / mode->binning);
+	else
+		snprintf(mode->name, sizeof(mode->name), "bin%d", mode->binning);
+	return 0;
+}
+
+//Thresholds a capture must meet to pass the check made with -o 128
+struct quality_limits {
+	double min_snr;		//dB, of every cell
+	double max_saturated;	//Percent of the pixels of any cell
+	double min_level;	//Percent of the white level, of the brightest cell
+};
+
+// Write the mean, variance and signal to noise ratio of every cell, from the
+// statistics gathered with the block sums, to filename, and check them
+// against limits. Returns 0 if the capture passes.
+int write_cell_stats(const char *filename, const struct sweep_combo *combo, int bayer_order,
+		uint32_t grid_width, uint32_t grid_height, unsigned int max_val, const struct quality_limits *limits)
+{
+	static const char *channel_names[NUM_CHANNELS] = { "R", "Gr", "Gb", "B" };
+	size_t c, cells = (size_t)grid_width*grid_height;
+	double window = (double)combo->block_size * combo->block_size;
+	double min_snr = 1000, max_saturated = 0, max_level = 0;
+	size_t min_snr_cell = 0;
+	int min_snr_channel = 0, i, failed = 0;
+	struct text_file *f;
+
+	if (!combo->stats[0].sum)
+	{
+		printf("No cell statistics without a raw capture\n");
+		return 0;
+	}
+	f = text_open(filename);
+	if (f)
+		text_str(f, "# x y channel mean variance snr_db saturated\n");
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		//In the order RGGB
+		int ch = channel_ordering[bayer_order][i];
+		const struct cell_stats *stats = &combo->stats[ch];
+
+		for (c=0; c<cells; c++)
+		{
+			uint32_t n = combo->block_count[ch][c];
+			double mean = combo->block_sum[ch][c] / window;
+			double raw_mean = n ? (double)stats->sum[c] / n : 0;
+			double var = n ? ((double)stats->sum_sq[c] / n - raw_mean * raw_mean) *
+					combo->stats_scale * combo->stats_scale : 0;
+			double snr = var > 0 ? 20 * log10(mean / sqrt(var)) : 99.9;
+			double saturated = n ? 100.0 * stats->saturated[c] / n : 0;
+
+			snr = snr < 99.9 ? snr : 99.9;
+			if (f)
+			{
+				text_uint(f, (uint32_t)(c % grid_width) * 32 + 16, " ");
+				text_uint(f, (uint32_t)(c / grid_width) * 32 + 16, " ");
+				text_uint(f, i, " ");
+				text_fixed(f, mean, 2, " ");
+				text_fixed(f, var > 0 ? var : 0, 2, " ");
+				text_fixed(f, snr, 1, " ");
+				text_uint(f, stats->saturated[c], "\n");
+			}
+			if (snr < min_snr)
+			{
+				min_snr = snr;
+				min_snr_cell = c;
+				min_snr_channel = i;
+			}
+			max_saturated = saturated > max_saturated ? saturated : max_saturated;
+			max_level = mean > max_level ? mean : max_level;
+		}
+	}
+	if (f && text_close(f))
+		printf("Failed to write %s\n", filename);
+
+	max_level = 100 * max_level / max_val;
+	printf("Brightest cell at %.1f%% of the white level, minimum %.1f%%: %s\n", max_level,
+			limits->min_level, max_level >= limits->min_level ? "ok" : "too dark");
+	printf("Lowest signal to noise ratio %.1f dB, at %u,%u %s, minimum %.1f dB: %s\n", min_snr,
+			(uint32_t)(min_snr_cell % grid_width), (uint32_t)(min_snr_cell / grid_width),
+			channel_names[min_snr_channel], limits->min_snr, min_snr >= limits->min_snr ? "ok" : "too noisy");
+	printf("Most saturated cell %.2f%% of pixels, maximum %.2f%%: %s\n", max_saturated,
+			limits->max_saturated, max_saturated <= limits->max_saturated ? "ok" : "clipped");
+	failed = max_level < limits->min_level || min_snr < limits->min_snr ||
+			max_saturated > limits->max_saturated;
+	printf("Capture check %s\n", failed ? "FAILED" : "passed");
+	return failed;
+}
+
+//Settings for turning block sums into tables
+struct table_options {
+	uint8_t out_frmt;
+	enum fit_model_t fit_model;
+	struct normalisation norm;
+	struct gain_format gain_fmt;
+	int num_targets;	//0 for the orientation of the input
+	unsigned int targets[TARGET_TRANSFORMS];
+	int num_modes;		//0 for the geometry of the input
+	struct sensor_mode modes[SENSOR_MODES_MAX];
+	struct quality_limits quality;
+	unsigned int max_val;
+};
+
+// Copy a channel's grid to dst, mirrored by the transform bits in flips
+// (1 = horizontal, 2 = vertical)
+void flip_grid(const uint32_t *src, uint32_t *dst, uint32_t grid_width, uint32_t grid_height,
+		uint32_t flips)
+{
+	uint32_t x, y;
+
+	for (y=0; y<grid_height; y++)
+	{
+		const uint32_t *row = src + (size_t)((flips&2) ? grid_height - 1 - y : y) * grid_width;
+
+		if (flips&1)
+		{
+			for (x=0; x<grid_width; x++)
+				dst[x] = row[grid_width - 1 - x];
+		}
+		else
+			memcpy(dst, row, grid_width * sizeof(uint32_t));
+		dst += grid_width;
+	}
+}
+
+// Write the block sums and counts of one combination of settings to
+// filename, with what is needed to make the tables from them again
+void write_block_sums(const char *filename, const struct sweep_combo *combo, int bayer_order,
+		uint32_t transform, int width, int height, uint32_t grid_width, uint32_t grid_height)
+{
+	size_t i, cells = (size_t)grid_width*grid_height;
+	struct text_file *f = text_open(filename);
+	int ch;
+
+	if (!f)
+		return;
+	text_printf(f, "%s\n", BLOCK_SUMS_ID);
+	text_printf(f, "width %d\n", width);
+	text_printf(f, "height %d\n", height);
+	text_printf(f, "grid %u %u\n", grid_width, grid_height);
+	text_printf(f, "bayer_order %d\n", bayer_order);
+	text_printf(f, "transform %u\n", transform);
+	text_printf(f, "block_size %d\n", combo->block_size);
+	text_printf(f, "black_level %u\n", combo->black_level);
+	text_printf(f, "estimator %s\n", estimator_names[combo->estimator]);
+	for (ch=0; ch<NUM_CHANNELS; ch++)
+	{
+		text_printf(f, "sum %d", ch);
+		for (i=0; i<cells; i++)
+		{
+			text_str(f, " ");
+			text_uint(f, combo->block_sum[ch][i], "");
+		}
+		text_printf(f, "\ncount %d", ch);
+		for (i=0; i<cells; i++)
+		{
+			text_str(f, " ");
+			text_uint(f, combo->block_count[ch][i], "");
+		}
+		text_str(f, "\n");
+	}
+	if (text_close(f))
+		printf("Failed to write %s\n", filename);
+}
+
+// Read block sums written by write_block_sums into combo, allocating its
+// arrays, and the image geometry into img and the grid size
+int parse_block_sums(const char *buf, size_t size, struct raw_image *img, struct sweep_combo *combo,
+		uint32_t *grid_width, uint32_t *grid_height)
+{
+	//The values are parsed from a terminated copy, as the file is mapped
+	//and strtoul would run on past its end
+	char *text = (char *)malloc(size + 1);
+	const char *p = text, *end = text + size;
+	unsigned int bayer_order = 4, transform = 0, black_level = 0;
+	char estimator[16] = "mean";
+	size_t cells = 0;
+	int ch, i, have[NUM_CHANNELS*2] = { 0 };
+
+	memset(img, 0, sizeof(*img));
+	*grid_width = *grid_height = 0;
+	if (!text)
+	{
+		printf("Not enough memory to read the block sums\n");
+		return -1;
+	}
+	memcpy(text, buf, size);
+	text[size] = '\0';
+	while (p < end)
+	{
+		const char *eol = memchr(p, '\n', end - p);
+		size_t len = eol ? (size_t)(eol - p) : (size_t)(end - p);
+		char line[64];
+		int kind = -1;
+
+		memcpy(line, p, len < sizeof(line) - 1 ? len : sizeof(line) - 1);
+		line[len < sizeof(line) - 1 ? len : sizeof(line) - 1] = '\0';
+		sscanf(line, "width %d", &img->width);
+		sscanf(line, "height %d", &img->height);
+		sscanf(line, "grid %u %u", grid_width, grid_height);
+		sscanf(line, "bayer_order %u", &bayer_order);
+		sscanf(line, "transform %u", &transform);
+		sscanf(line, "block_size %d", &combo->block_size);
+		sscanf(line, "black_level %u", &black_level);
+		sscanf(line, "estimator %15s", estimator);
+		if (sscanf(line, "sum %d", &ch) == 1)
+			kind = 0;
+		else if (sscanf(line, "count %d", &ch) == 1)
+			kind = 1;
+		if (kind >= 0 && ch >= 0 && ch < NUM_CHANNELS && cells)
+		{
+			//The values follow on the same line
+			uint32_t **values = kind ? combo->block_count : combo->block_sum;
+			char *next;
+			const char *q = p + strlen(kind ? "count 0" : "sum 0");
+
+			free(values[ch]);
+			values[ch] = (uint32_t *)calloc(cells, sizeof(uint32_t));
+			if (!values[ch])
+			{
+				printf("Not enough memory to read the block sums\n");
+				free(text);
+				return -1;
+			}
+			for (i=0; i<(int)cells && q < p + len; i++)
+			{
+				values[ch][i] = strtoul(q, &next, 10);
+				if (next == q)
+					break;
+				q = next;
+			}
+			have[ch*2 + kind] = i == (int)cells;
+		}
+		if (!cells && *grid_width && *grid_height)
+			cells = (size_t)*grid_width * *grid_height;
+		p += len + 1;
+	}
+	free(text);
+
+	for (i=0; i<NUM_CHANNELS*2 && have[i]; i++)
+		;
+	if (bayer_order > 3 || img->width <= 0 || img->height <= 0 || !cells ||
+			combo->block_size <= 0 || i < NUM_CHANNELS*2)
+	{
+		printf("Incomplete block sums file\n");
+		return -1;
+	}
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		//Cells are divided by, so must not be zero
+		size_t j;
+		for (j=0; j<cells; j++)
+			combo->block_sum[i][j] = combo->block_sum[i][j] ? combo->block_sum[i][j] : 1;
+	}
+	img->bayer_order = bayer_order;
+	img->transform = transform;
+	combo->black_level = black_level;
+	combo->estimator = EST_MEAN;
+	for (i=0; i<(int)(sizeof(estimator_names)/sizeof(estimator_names[0])); i++)
+	{
+		if (!strcmp(estimator, estimator_names[i]))
+			combo->estimator = i;
+	}
+	printf("Block sums of a %d x %d channel, grid %u x %u, cell size %d, black level %u, %s\n",
+			img->width, img->height, *grid_width, *grid_height, combo->block_size, black_level, estimator);
+	return 0;
+}
+
+// Fill a sensor mode's grid of block sums, by bilinear interpolation between
+// the centres of the cells of the full resolution grid src
+void resample_grid(const uint32_t *src, uint32_t grid_width, uint32_t grid_height,
+		uint32_t *dst, uint32_t mode_grid_width, uint32_t mode_grid_height, const struct sensor_mode *mode)
+{
+	uint32_t x, y;
+
+	for (y=0; y<mode_grid_height; y++)
+	{
+		//Cell centres in channel pixels of the mode, then of the full resolution
+		//channel, then in full resolution cells
+		double fy = ((mode->crop_y/2 + (y*32 + 16.0) * mode->binning - 0.5) - 15.5) / 32;
+		double wy;
+		uint32_t y0;
+
+		//Beyond the outer cell centres the edge cells are extrapolated
+		y0 = fy < 0 ? 0 : fy < grid_height - 1 ? (uint32_t)fy : grid_height > 1 ? grid_height - 2 : 0;
+		wy = grid_height > 1 ? fy - y0 : 0;
+		for (x=0; x<mode_grid_width; x++)
+		{
+			double fx = ((mode->crop_x/2 + (x*32 + 16.0) * mode->binning - 0.5) - 15.5) / 32;
+			const uint32_t *p;
+			double wx, top, bottom, v;
+			uint32_t x0, dx, dy;
+
+			x0 = fx < 0 ? 0 : fx < grid_width - 1 ? (uint32_t)fx : grid_width > 1 ? grid_width - 2 : 0;
+			wx = grid_width > 1 ? fx - x0 : 0;
+			dx = grid_width > 1;
+			dy = grid_height > 1 ? grid_width : 0;
+			p = src + (size_t)y0*grid_width + x0;
+			top = p[0] + (p[dx] - (double)p[0]) * wx;
+			bottom = p[dy] + (p[dy + dx] - (double)p[dy]) * wx;
+			v = top + (bottom - top) * wy;
+			dst[(size_t)y*mode_grid_width + x] = v < 1.0 ? 1 : (uint32_t)(v + 0.5);
+		}
+	}
+}
+
+// Work out and write the tables for each combination of settings from its
+// block sums. With several combinations each gets its own set, named by the
+// settings, and sweep.txt compares them. The tables are for each sensor mode
+// and target orientation, or those of the input if none were given. Returns
+// the number of combinations whose capture check failed.
+int emit_tables(struct sweep_combo *combos, int num_combos, const struct table_options *opts,
+		int bayer_order, uint32_t transform, int width, int height,
+		uint32_t grid_width, uint32_t grid_height)
+{
+	const struct gain_format *gf = &opts->gain_fmt;
+	int num_targets = opts->num_targets ? opts->num_targets : 1;
+	int num_modes = opts->num_modes ? opts->num_modes : 1;
+	FILE *report = NULL;
+	int i, k, m, t, failed = 0;
+
+	if (num_combos > 1)
+	{
+		report = fopen("sweep.txt", "wb");
+		if (report)
+			fprintf(report, "# cell_size black_level estimator mean_step min_gain max_gain\n");
+	}
+	for (k=0; k<num_combos; k++)
+	{
+		struct sweep_combo *combo = &combos[k];
+		char suffix[64] = "";
+
+		//With several combinations each gets its own tables
+		if (num_combos > 1)
+			snprintf(suffix, sizeof(suffix), "_s%d_b%u_%s", combo->block_size, combo->black_level,
+					estimator_names[combo->estimator]);
+
+		//The sums are saved before any fit replaces them
+		if (opts->out_frmt&0x40)
+		{
+			char filename[96];
+			snprintf(filename, sizeof(filename), "block_sums%s.txt", suffix);
+			write_block_sums(filename, combo, bayer_order, transform, width, height, grid_width, grid_height);
+		}
+		if (opts->out_frmt&0x80)
+		{
+			char filename[96];
+			snprintf(filename, sizeof(filename), "cell_stats%s.txt", suffix);
+			failed += write_cell_stats(filename, combo, bayer_order, grid_width, grid_height,
+					opts->max_val, &opts->quality);
+		}
+
+		//The surface is fitted in the orientation it was measured in, so
+		//that every orientation gets the same one
+		for (i=0; i<NUM_CHANNELS && opts->fit_model != FIT_NONE; i++)
+		{
+			int ch = channel_ordering[bayer_order][i];
+
+			if (!fit_block_sums(opts->fit_model, combo->block_sum[ch], combo->block_count[ch],
+					width, height, grid_width, grid_height))
+				printf("Surface fit failed for channel %d, using block values\n", i);
+		}
+
+		for (m=0; m<num_modes; m++)
+		{
+			const struct sensor_mode *mode = opts->num_modes ? &opts->modes[m] : NULL;
+			uint32_t mode_grid_width = grid_width, mode_grid_height = grid_height;
+			uint16_t *gains[NUM_CHANNELS];
+			uint32_t *mode_sum[NUM_CHANNELS], *sum[NUM_CHANNELS];
+			char mode_suffix[96];
+			size_t cells;
+
+			if (mode)
+			{
+				int crop_width = mode->crop_width ? mode->crop_width : width*2;
+				int crop_height = mode->crop_height ? mode->crop_height : height*2;
+
+				if (mode->crop_x + crop_width > width*2 || mode->crop_y + crop_height > height*2)
+				{
+					printf("Sensor mode %s is outside the %d x %d image\n", mode->name, width*2, height*2);
+					continue;
+				}
+				mode_grid_width = (crop_width / mode->binning / 2 + 31) / 32;
+				mode_grid_height = (crop_height / mode->binning / 2 + 31) / 32;
+				if (!k)
+					printf("Sensor mode %s: %d x %d, grid size %u x %u\n", mode->name,
+							crop_width / mode->binning, crop_height / mode->binning,
+							mode_grid_width, mode_grid_height);
+			}
+			if (num_modes > 1)
+				snprintf(mode_suffix, sizeof(mode_suffix), "%s_%s", suffix, mode->name);
+			else
+				snprintf(mode_suffix, sizeof(mode_suffix), "%s", suffix);
+
+			cells = (size_t)mode_grid_width*mode_grid_height;
+			for (i=0; i<NUM_CHANNELS; i++)
+			{
+				gains[i] = (uint16_t *)malloc(cells * sizeof(uint16_t));
+				sum[i] = (uint32_t *)malloc(cells * sizeof(uint32_t));
+				mode_sum[i] = combo->block_sum[i];
+				if (mode)
+				{
+					//Resampled on the coarse grid, not decoded again
+					mode_sum[i] = (uint32_t *)malloc(cells * sizeof(uint32_t));
+					resample_grid(combo->block_sum[i], grid_width, grid_height,
+							mode_sum[i], mode_grid_width, mode_grid_height, mode);
+				}
+			}
+
+			for (t=0; t<num_targets; t++)
+			{
+				//Each orientation is the mode's grid mirrored, so the sums are
+				//permuted rather than measured again
+				uint32_t target = opts->num_targets ? opts->targets[t] : transform;
+				char target_suffix[112];
+				struct gain_clamps clamps = { 0, 0 };
+
+				for (i=0; i<NUM_CHANNELS; i++)
+					flip_grid(mode_sum[i], sum[i], mode_grid_width, mode_grid_height, target ^ transform);
+				if (num_targets > 1)
+					snprintf(target_suffix, sizeof(target_suffix), "%s_t%u", mode_suffix, target);
+				else
+					snprintf(target_suffix, sizeof(target_suffix), "%s", mode_suffix);
+
+				for (i=0; i<NUM_CHANNELS; i++)
+				{
+					//Write out the lens shading table in the order RGGB
+					int ch = channel_ordering[bayer_order][i];
+
+					compute_gains(sum[ch], mode_grid_width, mode_grid_height, combo->block_size,
+							&opts->norm, gf, gains[i], &clamps);
+				}
+				if (!m && !t)
+				{
+					printf("Cells clipped at the maximum gain of %.3f: %u\n",
+							((1 << (gf->int_bits + gf->frac_bits)) - 1) / (double)(1 << gf->frac_bits), clamps.clipped);
+					printf("Cells held at unity gain above the reference level: %u\n", clamps.floored);
+				}
+
+				write_tables(target_suffix, opts->out_frmt, gains, channel_ordering[bayer_order],
+						mode_grid_width, mode_grid_height, target, gf);
+				if (opts->out_frmt&0x20)
+				{
+					//The block sums, fitted if asked, in the order R, Gr, Gb, B
+					const uint32_t *sums[NUM_CHANNELS];
+					for (i=0; i<NUM_CHANNELS; i++)
+						sums[i] = sum[channel_ordering[bayer_order][i]];
+					write_colour_tables(target_suffix, sums, mode_grid_width, mode_grid_height, target, gf);
+				}
+				//The orientations and modes only differ in layout, so one is compared
+				if (report && !m && !t)
+					report_sweep(report, combo, combo->black_level, gains, mode_grid_width, mode_grid_height, gf);
+			}
+
+			for (i=0; i<NUM_CHANNELS; i++)
+			{
+				free(gains[i]);
+				free(sum[i]);
+				if (mode)
+					free(mode_sum[i]);
+			}
+		}
+	}
+	if (report)
+		fclose(report);
+	return failed;
+}
+
+//How the cells are averaged over the frames of a stream
+enum stream_average_t {
+	STREAM_WINDOW,		//Mean of the last frames
+	STREAM_EMA,		//Exponential moving average
+};
+
+struct stream_options {
+	unsigned int interval;		//Frames between writing the tables
+	enum stream_average_t average;
+	unsigned int window;		//Frames, for STREAM_WINDOW
+	double alpha;			//Weight of each new frame, for STREAM_EMA
+};
+
+//The decode and block sums of one grid row of a stream frame
+struct stream_row_job {
+	const struct raw_image *img;
+	const uint16_t *black_lut;
+	block_sums_fn block_sums;
+	uint16_t *buf[NUM_CHANNELS];	//block_size lines of each channel
+	uint32_t grid_width, grid_y;
+	int block_size;
+	uint32_t *block_sum[NUM_CHANNELS];
+};
+
+static void run_stream_row(void *arg)
+{
+	struct stream_row_job *job = (struct stream_row_job *)arg;
+	int width = job->img->width/2, height = job->img->height/2;
+	struct decode_job decode;
+	int i, y_start, y_stop;
+
+	//Only the lines of the analysis windows are unpacked
+	window_range(job->grid_y, job->block_size, height, &y_start, &y_stop);
+	decode.img = job->img;
+	decode.black_lut = job->black_lut;
+	for (i=0; i<NUM_CHANNELS; i++)
+		decode.channel[i] = job->buf[i];
+	decode.strip_y = y_start;
+	decode.rows = y_stop - y_start;
+	decode.first = y_start;
+	decode.last = y_stop;
+	run_decode(&decode);
+
+	for (i=0; i<NUM_CHANNELS; i++)
+		job->block_sums(job->buf[i], NULL, width, height, y_start, job->grid_width,
+				job->grid_y, job->grid_y + 1, job->block_size, job->block_sum[i], NULL, NULL);
+}
+
+// Read all of count bytes from fd, as a pipe may return fewer. Returns the
+// number read, short only at the end of the stream.
+size_t read_all(int fd, uint8_t *buf, size_t count)
+{
+	size_t done = 0;
+
+	while (done < count)
+	{
+		ssize_t ret = read(fd, buf + done, count - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+// Analyse a stream of headerless raw frames read from fd, as from a camera
+// held on a uniform target, keeping a running average and variance of every
+// cell. The tables are written every so many frames and at the end.
+int run_stream(int fd, const struct raw_format *fmt, int block_size, enum estimator_t estimator,
+		unsigned int black_level, const struct stream_options *so, const struct table_options *opts,
+		int num_threads)
+{
+	struct raw_image img;
+	struct stream_row_job *jobs = NULL;
+	struct sweep_combo combo;
+	uint16_t *black_lut = NULL, *row_buf = NULL;
+	uint32_t *frame_sum[NUM_CHANNELS] = { NULL }, *ring = NULL;
+	uint64_t *total[NUM_CHANNELS] = { NULL }, *total_sq[NUM_CHANNELS] = { NULL };
+	double *mean[NUM_CHANNELS] = { NULL }, *var[NUM_CHANNELS] = { NULL };
+	uint32_t grid_width, grid_height, y;
+	unsigned int frames = 0;
+	size_t stride, frame_size, cells, c, got;
+	uint8_t *frame = NULL;
+	struct timespec start, stop;
+	double busy = 0;
+	int i, failed, ret = -1;
+
+	memset(&img, 0, sizeof(img));
+	memset(&combo, 0, sizeof(combo));
+	if (!fmt->pixel_format || parse_pixel_format(fmt->pixel_format, &img) ||
+			fmt->width <= 0 || fmt->height <= 0)
+	{
+		printf("A stream needs the frames' --format, --width and --height\n");
+		return -1;
+	}
+	stride = fmt->stride ? (size_t)fmt->stride : packing_stride(img.packing, fmt->width);
+	frame_size = fmt->offset + stride * fmt->height;
+	frame = (uint8_t *)malloc(frame_size);
+	if (!frame)
+	{
+		printf("Not enough memory for a frame of the stream\n");
+		goto done;
+	}
+	if (read_all(fd, frame, frame_size) < frame_size || parse_raw_file(frame, frame_size, fmt, &img))
+	{
+		printf("No whole frame in the stream\n");
+		goto done;
+	}
+	if (!black_level)
+		black_level = img.black_level ? img.black_level : 16;
+	printf("Black level: %u\n", black_level);
+	if (black_level >= img.max_val)
+	{
+		printf("Black level must be below the white level %u\n", img.max_val);
+		goto done;
+	}
+	grid_width = (img.width/2 + 31) / 32;
+	grid_height = (img.height/2 + 31) / 32;
+	cells = (size_t)grid_width*grid_height;
+	printf("Grid size: %d x %d\n", grid_width, grid_height);
+	if (so->average == STREAM_WINDOW)
+		printf("Averaging over the last %u frames, tables every %u frames\n", so->window, so->interval);
+	else
+		printf("Averaging with a weight of %g per frame, tables every %u frames\n", so->alpha, so->interval);
+
+	combo.block_size = block_size;
+	combo.black_level = black_level;
+	combo.estimator = estimator;
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		frame_sum[i] = (uint32_t *)malloc(cells * sizeof(uint32_t));
+		mean[i] = (double *)calloc(cells, sizeof(double));
+		var[i] = (double *)calloc(cells, sizeof(double));
+		combo.block_sum[i] = (uint32_t *)malloc(cells * sizeof(uint32_t));
+		combo.block_count[i] = (uint32_t *)malloc(cells * sizeof(uint32_t));
+		if (so->average == STREAM_WINDOW)
+		{
+			total[i] = (uint64_t *)calloc(cells, sizeof(uint64_t));
+			total_sq[i] = (uint64_t *)calloc(cells, sizeof(uint64_t));
+		}
+	}
+	if (so->average == STREAM_WINDOW)
+		ring = (uint32_t *)malloc((size_t)so->window * NUM_CHANNELS * cells * sizeof(uint32_t));
+
+	//Each grid row is decoded and summed on its own, into its own lines
+	jobs = (struct stream_row_job *)malloc(grid_height * sizeof(struct stream_row_job));
+	row_buf = (uint16_t *)malloc((size_t)grid_height * NUM_CHANNELS * block_size * (img.width/2) * sizeof(uint16_t));
+	black_lut = (uint16_t *)malloc(packing_range(img.packing) * sizeof(uint16_t));
+	failed = !jobs || !row_buf || !black_lut || (so->average == STREAM_WINDOW && !ring);
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		failed |= !frame_sum[i] || !mean[i] || !var[i] || !combo.block_sum[i] || !combo.block_count[i];
+		if (so->average == STREAM_WINDOW)
+			failed |= !total[i] || !total_sq[i];
+	}
+	if (failed)
+	{
+		printf("Not enough memory to analyse the stream\n");
+		goto done;
+	}
+	for (c=0; c<packing_range(img.packing); c++)
+		black_lut[c] = black_level_correct(c, black_level, img.max_val);
+
+	for (y=0; y<grid_height; y++)
+	{
+		struct stream_row_job *job = &jobs[y];
+
+		job->img = &img;
+		job->black_lut = black_lut;
+		job->block_sums = select_block_sums(block_size, estimator);
+		job->grid_width = grid_width;
+		job->grid_y = y;
+		job->block_size = block_size;
+		for (i=0; i<NUM_CHANNELS; i++)
+		{
+			job->buf[i] = row_buf + ((size_t)y*NUM_CHANNELS + i) * block_size * (img.width/2);
+			job->block_sum[i] = frame_sum[i];	//Indexed from the first grid row
+		}
+	}
+
+	do
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		run_jobs(run_stream_row, jobs, sizeof(struct stream_row_job), grid_height, num_threads);
+		frames++;
+
+		for (i=0; i<NUM_CHANNELS; i++)
+		{
+			if (so->average == STREAM_WINDOW)
+			{
+				//Exact running totals, with the oldest frame's sums dropped
+				uint32_t *slot = ring + ((size_t)((frames - 1) % so->window) * NUM_CHANNELS + i) * cells;
+				double n = frames < so->window ? frames : so->window;
+
+				for (c=0; c<cells; c++)
+				{
+					uint64_t v = frame_sum[i][c];
+					if (frames > so->window)
+					{
+						total[i][c] -= slot[c];
+						total_sq[i][c] -= (uint64_t)slot[c] * slot[c];
+					}
+					slot[c] = v;
+					total[i][c] += v;
+					total_sq[i][c] += v * v;
+					mean[i][c] = total[i][c] / n;
+					var[i][c] = total_sq[i][c] / n - mean[i][c] * mean[i][c];
+				}
+			}
+			else
+			{
+				//The first frame starts the average
+				double alpha = frames == 1 ? 1.0 : so->alpha;
+				for (c=0; c<cells; c++)
+				{
+					double diff = frame_sum[i][c] - mean[i][c];
+					double incr = alpha * diff;
+					mean[i][c] += incr;
+					var[i][c] = (1 - alpha) * (var[i][c] + diff * incr);
+				}
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		busy += (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+
+		got = read_all(fd, frame, frame_size);
+		if (frames % so->interval == 0 || got < frame_size)
+		{
+			//The relative noise of the averaged cells shows how far they have settled
+			double noise = 0;
+
+			for (i=0; i<NUM_CHANNELS; i++)
+			{
+				for (c=0; c<cells; c++)
+				{
+					combo.block_sum[i][c] = mean[i][c] < 1.0 ? 1 : (uint32_t)(mean[i][c] + 0.5);
+					combo.block_count[i][c] = block_size * block_size;
+					noise += sqrt(var[i][c] > 0 ? var[i][c] : 0) / (mean[i][c] > 1.0 ? mean[i][c] : 1.0);
+				}
+			}
+			printf("Frame %u: cell noise %.3f%%\n", frames, noise * 100 / (NUM_CHANNELS * cells));
+			emit_tables(&combo, 1, opts, img.bayer_order, img.transform, img.width/2, img.height/2,
+					grid_width, grid_height);
+		}
+	}
+	while (got == frame_size);
+	if (got)
+		printf("Ignoring %zu bytes of a partial frame at the end of the stream\n", got);
+	printf("%u frames, %.3f ms per frame\n", frames, busy * 1000 / frames);
+	ret = 0;
+
+done:
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		free(frame_sum[i]);
+		free(mean[i]);
+		free(var[i]);
+		free(total[i]);
+		free(total_sq[i]);
+		free(combo.block_sum[i]);
+		free(combo.block_count[i]);
+	}
+	free(ring);
+	free(jobs);
+	free(row_buf);
+	free(black_lut);
+	free(frame);
+	return ret;
+}
+
+void print_help(void)
+{
+	printf("\n");
+	printf("\n");
+	printf("\"lens_shading_analyse\" Lens shading analysis tool\n");
+	printf("\n");
+	printf("Analyzes the lens shading based on a raw image\n");
+	printf("\n");
+	printf("usage: lens_shading_analyse -i <filename> [options]\n");
+	printf("\n");
+	printf("Parameters\n");
+	printf("\n");
+	printf("-i  : Raw image file (mandatory), or the channels.txt or channels.lsc\n");
+	printf("      written with -o 8 to re-analyse saved channel planes. Several raw\n");
+	printf("      files, each with -i, are median combined into master_flat.dng\n");
+	printf("-b  : Black level\n");
+	printf("-s  : Size of the analysis cell. Minimum 2, maximum 32, default 4\n");
+	printf("      -b, -s and --estimator take comma separated lists to sweep over every\n");
+	printf("      combination, with tables for each and a comparison in sweep.txt\n");
+	printf("-o  : Output format. Formats can be output together, for example 3 = 1 + 2\n");
+	printf("      1  : Header file (default on)\n");
+	printf("      2  : Binary file\n");
+	printf("      4  : Text file\n");
+	printf("      8  : Channel data, described by channels.txt\n");
+	printf("      16 : Defect map (defects.txt)\n");
+	printf("      32 : Luminance and colour (R/G, B/G) shading tables (ls_colour.h, .txt)\n");
+	printf("      64 : Block sums (block_sums.txt), which can be given back to -i to\n");
+	printf("           make the tables again with other settings\n");
+	printf("      128: Mean, variance and signal to noise ratio of each cell\n");
+	printf("           (cell_stats.txt), and a check of the capture against the limits\n");
+	printf("           below. A capture that fails exits with status 2.\n");
+	printf("--plane-format : File format of the channel data written with -o 8\n");
+	printf("      bin : Headerless 16 bit samples, ch1.bin-ch4.bin (default)\n");
+	printf("      pgm : 16 bit PGM, ch1.pgm-ch4.pgm\n");
+	printf("      tiff : Uncompressed 16 bit TIFF, ch1.tif-ch4.tif\n");
+	printf("      lsc : All four channels losslessly compressed into channels.lsc,\n");
+	printf("            which can be given back to -i for re-analysis\n");
+	printf("--preview : Write each channel downsampled by this factor (1 to %d) to\n", PREVIEW_FACTOR_MAX);
+	printf("      ch1_preview.pgm-ch4_preview.pgm\n");
+	printf("--preview-format : File format of the preview\n");
+	printf("      pgm : A 16 bit PGM for each channel (default)\n");
+	printf("      csv : All four channels in heatmap.csv, a line per box as\n");
+	printf("            x,y,r,gr,gb,b, with a blank line after each row for gnuplot\n");
+	printf("--threads : Number of threads (default one per CPU) for:\n");
+	printf("      compressing and decompressing the channel planes\n");
+	printf("      the block sums of the channels and of each combination of a sweep\n");
+	printf("      measuring and decoding a dark frame alongside the flat field\n");
+	printf("      median combining several flats or darks into a master\n");
+	printf("      the grid rows of each frame of a --stream\n");
+	printf("--defect-threshold : Exclude pixels deviating more than this percentage from\n");
+	printf("      their same colour neighbours from the analysis. 0 = off (default),\n");
+	printf("      %d if the defect map is requested\n", DEFECT_THRESHOLD_DEFAULT);
+	printf("--estimator : Statistic of the analysis cell used for its value\n");
+	printf("      mean : Mean of the pixels (default)\n");
+	printf("      median : Median of the pixels\n");
+	printf("      trimmed : Mean of the pixels between the lower and upper quartiles\n");
+	printf("--raw-sums : Sum the raw values, and correct for the black level per cell\n");
+	printf("      rather than per pixel. Faster, and shared by a sweep of black levels.\n");
+	printf("-d  : Dark frame of the same sensor mode, to measure and remove the black\n");
+	printf("      level instead of -b. Several are median combined into master_dark.dng\n");
+	printf("--cache : Directory to keep master frames in, named by sensor model, mode and\n");
+	printf("      exposure, and reused while newer than the frames they were made from\n");
+	printf("--exposure : Exposure time in microseconds for the cache, if not in the file\n");
+	printf("--dark-mode : How the dark frame is removed\n");
+	printf("      level : Its mean level, per cell as --raw-sums does\n");
+	printf("      cell : Its statistics for each cell (default)\n");
+	printf("      pixel : Pixel by pixel\n");
+	printf("--lowpass : Use the mean of every pixel in each grid cell instead of\n");
+	printf("      sampling a window of -s pixels at the centre of the cell\n");
+	printf("--mem-limit : Approximate memory budget for the decoded image data, with\n");
+	printf("      optional k, M or G suffix. The image is processed in strips to fit.\n");
+	printf("--format : Pixel format of a headerless raw buffer, as named by libcamera:\n");
+	printf("      S<order>10_CSI2P, S<order>12_CSI2P, or S<order><bits> (10 to 16)\n");
+	printf("      for 16 bit samples, or <order>_PISP_COMP1 for Pi 5 compressed raw, where\n");
+	printf("      <order> is RGGB, GBRG, BGGR or GRBG\n");
+	printf("--width, --height : Size of a headerless raw buffer in pixels\n");
+	printf("--stride : Line length of a headerless raw buffer in bytes (default minimum)\n");
+	printf("--offset : Offset of the image within the file in bytes (default 0)\n");
+	printf("--gain-format : Fixed point format of the gains as integer.fraction bits,\n");
+	printf("      default 3.5. Over 8 bits in all the tables hold 16 bit values.\n");
+	printf("--normalise : Level of each channel that is given a gain of 1.0\n");
+	printf("      max : Its brightest cell (default)\n");
+	printf("      percentile[:P] : The Pth percentile of its cells (default 98)\n");
+	printf("      centre : The middle cells of the grid\n");
+	printf("      fixed:<level> : This black level subtracted pixel value\n");
+	printf("      Cells above the level are left at 1.0.\n");
+	printf("--no-clip : Lower the level where needed so no gain is clipped\n");
+	printf("--target-transform : Comma separated orientations to write the tables for,\n");
+	printf("      0 to 3, as the header's transform: 1 = horizontal flip, 2 = vertical.\n");
+	printf("      With several each set is named by it, as ls_table_t1.h.\n");
+	printf("--sensor-mode : Resample the tables for a cropped or binned sensor mode, given\n");
+	printf("      as [<width>x<height>[+<x>+<y>]][:<binning>] in full resolution pixels,\n");
+	printf("      for example 4056x3040:2. Can be given up to %d times, when each set is\n", SENSOR_MODES_MAX);
+	printf("      named by the mode's size, as ls_table_2028x1520.h.\n");
+	printf("--exposure-check : Check the exposure of a raw flat field from a sample of\n");
+	printf("      its lines before analysing it\n");
+	printf("      off : No check\n");
+	printf("      warn : Report an exposure out of range and carry on (default)\n");
+	printf("      abort : Stop with exit status 2 on an exposure out of range\n");
+	printf("--exposure-range : Range for the median of the brightest channel, as\n");
+	printf("      <min>,<max> percent of the range above black (default 20,95)\n");
+	printf("--max-clipped : Highest percentage of any channel within 1/%d of the white\n", SATURATION_MARGIN);
+	printf("      level for the exposure check (default 5)\n");
+	printf("--min-snr : Lowest signal to noise ratio of any cell for -o 128, in dB\n");
+	printf("      (default 20)\n");
+	printf("--max-saturated : Highest percentage of pixels of any cell within 1/%d of\n", SATURATION_MARGIN);
+	printf("      the white level for -o 128 (default 1)\n");
+	printf("--min-level : Lowest level of the brightest cell for -o 128, as a\n");
+	printf("      percentage of the white level (default 20)\n");
+	printf("--stream : Read a stream of headerless raw frames, given by --format, from -i\n");
+	printf("      or stdin, and write the tables every this many frames and at the end\n");
+	printf("--stream-average : How the cells are averaged over the stream\n");
+	printf("      window:<frames> : Mean of the last frames, up to %d (default 30)\n", STREAM_WINDOW_MAX);
+	printf("      ema:<weight> : Exponential moving average, weighting each new frame\n");
+	printf("                     by 0 to 1\n");
+	printf("--fit : Fit a smooth surface to the block values before computing the gains\n");
+	printf("      radial : Radial polynomial (r^2, r^4, r^6) plus linear tilt\n");
+	printf("      spline : Cubic B-spline surface with up to %dx%d control points\n", SPLINE_KNOTS_MAX, SPLINE_KNOTS_MAX);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int in = 0;
+	struct text_file *defects = NULL;
+	int plane_fd[NUM_CHANNELS] = { -1, -1, -1, -1 };
+	enum plane_format_t plane_format = PLANE_BIN;
+	uint8_t plane_hdr[PLANE_HEADER_MAX];
+	size_t plane_hdr_len = 0;
+	int preview_factor = 0, preview_width = 0, preview_height = 0, preview_csv = 0;
+	uint32_t *preview_sum[NUM_CHANNELS] = { NULL };
+	int lsc_fd = -1;
+	struct lsc_file lsc = { 0 };
+	struct plane_files planes = { 0 };
+	int corrected_input = 0;
+	const char *in_name = NULL;
+	int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, j, k, x, y;
+	uint16_t *strip_buf[NUM_CHANNELS] = { NULL };
+	int strip_rows, strip_y;
+	size_t line_bytes, mem_limit = 0;
+	uint8_t *defect_mask[NUM_CHANNELS] = { NULL };
+	unsigned int defect_threshold = 0, num_defects = 0;
+	enum fit_model_t fit_model = FIT_NONE;
+	int lowpass = 0;
+	int raw_sums = 0, raw_stats, plane_outputs, sidecar = 0;
+	uint16_t max_val;
+	void *mmap_buf;
+	struct stat sb;
+	struct raw_image img;
+	struct raw_format raw_fmt = { NULL, 0, 0, 0, 0 }, dark_fmt;
+	const char *flat_names[MASTER_FRAMES_MAX], *dark_names[MASTER_FRAMES_MAX];
+	int num_flats = 0, num_darks = 0;
+	const char *cache_dir = NULL;
+	uint32_t exposure_us = 0;
+	char master_flat[PATH_MAX], master_dark[PATH_MAX];
+	const char *dark_name = NULL;
+	int dark_fd = -1;
+	void *dark_buf = MAP_FAILED;
+	size_t dark_size = 0;
+	struct raw_image dark_img;
+	enum dark_mode_t dark_mode = DARK_CELL;
+	uint16_t *dark_strip_buf[NUM_CHANNELS] = { NULL };
+	struct decode_job decode_jobs[2];
+	int num_decodes;
+	uint16_t *black_lut[SWEEP_MAX] = { NULL };
+	uint16_t *corr_buf[NUM_CHANNELS] = { NULL };
+	uint16_t *swap_buf = NULL;
+	int bayer_order;
+	int width, height;
+	size_t stride;
+	uint32_t grid_width, grid_height;
+	size_t grid_cells;
+	int single_channel_width, single_channel_height;
+	unsigned int black_levels[SWEEP_MAX];
+	unsigned int block_sizes[SWEEP_MAX];
+	enum estimator_t estimators[SWEEP_MAX];
+	int num_black_levels = 0, num_block_sizes = 0, num_estimators = 0;
+	struct sweep_combo *combos = NULL;
+	int num_combos = 0, combos_per_black, num_jobs;
+	struct block_sums_job *jobs = NULL;
+	struct gain_format gain_fmt = { 3, 5 };
+	struct normalisation norm = { NORM_MAX, 0, 0 };
+	unsigned int targets[TARGET_TRANSFORMS] = { 0 };
+	int num_targets = 0;
+	struct sensor_mode modes[SENSOR_MODES_MAX];
+	int num_modes = 0;
+	struct stream_options stream = { 0, STREAM_WINDOW, 30, 0.1 };
+	struct quality_limits quality = { 20.0, 1.0, 20.0 };
+	struct exposure_limits exposure = { EXPOSURE_WARN, 20.0, 95.0, 5.0 };
+	int check_failed = 0, status = 1;
+	struct table_options table_opts;
+	uint8_t out_frmt = 1;
+
+	if (argc < 2)
+	{
+		print_help();
+		return -1;
+	}
+
+	static const struct option long_options[] = {
+		{ "defect-threshold", required_argument, NULL, 'D' },
+		{ "fit", required_argument, NULL, 'F' },
+		{ "lowpass", no_argument, NULL, 'L' },
+		{ "mem-limit", required_argument, NULL, 'M' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "width", required_argument, NULL, 'W' },
+		{ "height", required_argument, NULL, 'H' },
+		{ "stride", required_argument, NULL, 'S' },
+		{ "offset", required_argument, NULL, 'O' },
+		{ "plane-format", required_argument, NULL, 'P' },
+		{ "preview", required_argument, NULL, 'p' },
+		{ "preview-format", required_argument, NULL, 'V' },
+		{ "threads", required_argument, NULL, 'T' },
+		{ "estimator", required_argument, NULL, 'E' },
+		{ "raw-sums", no_argument, NULL, 'R' },
+		{ "dark-mode", required_argument, NULL, 'k' },
+		{ "cache", required_argument, NULL, 'C' },
+		{ "exposure", required_argument, NULL, 'X' },
+		{ "gain-format", required_argument, NULL, 'G' },
+		{ "normalise", required_argument, NULL, 'N' },
+		{ "no-clip", no_argument, NULL, 'c' },
+		{ "target-transform", required_argument, NULL, 't' },
+		{ "sensor-mode", required_argument, NULL, 'm' },
+		{ "stream", required_argument, NULL, 'n' },
+		{ "min-snr", required_argument, NULL, 'q' },
+		{ "max-saturated", required_argument, NULL, 'x' },
+		{ "min-level", required_argument, NULL, 'l' },
+		{ "exposure-check", required_argument, NULL, 'e' },
+		{ "exposure-range", required_argument, NULL, 'r' },
+		{ "max-clipped", required_argument, NULL, 'K' },
+		{ "stream-average", required_argument, NULL, 'a' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int nArg;
+	while ((nArg = getopt_long(argc, argv, "b:d:i:o:s:", long_options, NULL)) != -1)
+	{
+		switch (nArg) {
+		case 'D':
+			defect_threshold = strtoul(optarg, NULL, 10);
+			break;
+		case 'L':
+			lowpass = 1;
+			break;
+		case 'R':
+			raw_sums = 1;
+			break;
+		case 'M':
+			mem_limit = parse_size(optarg);
+			break;
+		case 'f':
+			raw_fmt.pixel_format = optarg;
+			break;
+		case 'W':
+			raw_fmt.width = strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			raw_fmt.height = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			raw_fmt.stride = strtoul(optarg, NULL, 10);
+			break;
+		case 'O':
+			raw_fmt.offset = parse_size(optarg);
+			break;
+		case 'd':
+			if (num_darks == MASTER_FRAMES_MAX)
+			{
+				printf("Too many dark frames\n");
+				return -1;
+			}
+			dark_names[num_darks++] = optarg;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'X':
+			exposure_us = strtoul(optarg, NULL, 10);
+			break;
+		case 'G':
+			if (sscanf(optarg, "%d.%d", &gain_fmt.int_bits, &gain_fmt.frac_bits) != 2 ||
+					gain_fmt.int_bits < 1 || gain_fmt.frac_bits < 0 ||
+					gain_fmt.int_bits + gain_fmt.frac_bits > 16)
+			{
+				printf("Invalid gain format %s, expected integer.fraction bits up to 16 in all\n", optarg);
+				return -1;
+			}
+			break;
+		case 'N':
+			if (!strcmp(optarg, "max"))
+				norm.mode = NORM_MAX;
+			else if (!strcmp(optarg, "centre"))
+				norm.mode = NORM_CENTRE;
+			else if (!strncmp(optarg, "percentile", 10) && (!optarg[10] || optarg[10] == ':'))
+			{
+				norm.mode = NORM_PERCENTILE;
+				norm.value = optarg[10] ? strtod(optarg + 11, NULL) : 98.0;
+			}
+			else if (!strncmp(optarg, "fixed:", 6))
+			{
+				norm.mode = NORM_FIXED;
+				norm.value = strtod(optarg + 6, NULL);
+			}
+			else
+			{
+				printf("Unknown normalisation %s\n", optarg);
+				return -1;
+			}
+			if ((norm.mode == NORM_PERCENTILE && (norm.value <= 0 || norm.value > 100)) ||
+					(norm.mode == NORM_FIXED && norm.value <= 0))
+			{
+				printf("Normalisation %s out of range\n", optarg);
+				return -1;
+			}
+			break;
+		case 'c':
+			norm.no_clip = 1;
+			break;
+		case 'V':
+			if (!strcmp(optarg, "pgm"))
+				preview_csv = 0;
+			else if (!strcmp(optarg, "csv"))
+				preview_csv = 1;
+			else
+			{
+				printf("Unknown preview format %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'e':
+			if (!strcmp(optarg, "off"))
+				exposure.check = EXPOSURE_OFF;
+			else if (!strcmp(optarg, "warn"))
+				exposure.check = EXPOSURE_WARN;
+			else if (!strcmp(optarg, "abort"))
+				exposure.check = EXPOSURE_ABORT;
+			else
+			{
+				printf("Unknown exposure check %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'r':
+			if (sscanf(optarg, "%lf,%lf", &exposure.min_median, &exposure.max_median) != 2 ||
+					exposure.min_median < 0 || exposure.max_median > 100 ||
+					exposure.min_median > exposure.max_median)
+			{
+				printf("Invalid exposure range %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'K':
+			exposure.max_clipped = strtod(optarg, NULL);
+			break;
+		case 'q':
+			quality.min_snr = strtod(optarg, NULL);
+			break;
+		case 'x':
+			quality.max_saturated = strtod(optarg, NULL);
+			break;
+		case 'l':
+			quality.min_level = strtod(optarg, NULL);
+			break;
+		case 'n':
+			stream.interval = strtoul(optarg, NULL, 10);
+			if (!stream.interval)
+			{
+				printf("The stream needs an interval of at least one frame\n");
+				return -1;
+			}
+			break;
+		case 'a':
+			if (!strncmp(optarg, "window:", 7))
+			{
+				stream.average = STREAM_WINDOW;
+				stream.window = strtoul(optarg + 7, NULL, 10);
+			}
+			else if (!strncmp(optarg, "ema:", 4))
+			{
+				stream.average = STREAM_EMA;
+				stream.alpha = strtod(optarg + 4, NULL);
+			}
+			else
+			{
+				printf("Unknown stream average %s\n", optarg);
+				return -1;
+			}
+			//The window's squared sums are kept exactly in 64 bits
+			if ((stream.average == STREAM_WINDOW && (stream.window < 1 || stream.window > STREAM_WINDOW_MAX)) ||
+					(stream.average == STREAM_EMA && (stream.alpha <= 0 || stream.alpha > 1)))
+			{
+				printf("Stream average %s out of range\n", optarg);
+				return -1;
+			}
+			break;
+		case 'm':
+			if (num_modes == SENSOR_MODES_MAX)
+			{
+				printf("Too many sensor modes\n");
+				return -1;
+			}
+			if (parse_sensor_mode(optarg, &modes[num_modes]))
+			{
+				printf("Invalid sensor mode %s\n", optarg);
+				return -1;
+			}
+			for (i=0; i<num_modes; i++)
+			{
+				//The files of each are named by its size
+				if (!strcmp(modes[i].name, modes[num_modes].name))
+				{
+					printf("Sensor modes %s and %s are the same size\n", optarg, modes[i].name);
+					return -1;
+				}
+			}
+			num_modes++;
+			break;
+		case 't':
+			num_targets = parse_list(optarg, targets, TARGET_TRANSFORMS);
+			if (num_targets < 0)
+			{
+				printf("Too many target transforms\n");
+				return -1;
+			}
+			for (i=0; i<num_targets; i++)
+			{
+				if (targets[i] >= TARGET_TRANSFORMS)
+				{
+					printf("Target transform out of range\n");
+					return -1;
+				}
+			}
+			break;
+		case 'k':
+			if (!strcmp(optarg, "level"))
+				dark_mode = DARK_LEVEL;
+			else if (!strcmp(optarg, "cell"))
+				dark_mode = DARK_CELL;
+			else if (!strcmp(optarg, "pixel"))
+				dark_mode = DARK_PIXEL;
+			else
+			{
+				printf("Unknown dark frame mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'P':
+			if (!strcmp(optarg, "bin"))
+				plane_format = PLANE_BIN;
+			else if (!strcmp(optarg, "pgm"))
+				plane_format = PLANE_PGM;
+			else if (!strcmp(optarg, "tiff"))
+				plane_format = PLANE_TIFF;
+			else if (!strcmp(optarg, "lsc"))
+				plane_format = PLANE_LSC;
+			else
+			{
+				printf("Unknown plane format %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'p':
+			preview_factor = strtoul(optarg, NULL, 10);
+			if (preview_factor <= 0 || preview_factor > PREVIEW_FACTOR_MAX)
+			{
+				printf("Preview factor out of range\n");
+				return -1;
+			}
+			break;
+		case 'T':
+			num_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'F':
+			if (!strcmp(optarg, "radial"))
+				fit_model = FIT_RADIAL;
+			else if (!strcmp(optarg, "spline"))
+				fit_model = FIT_SPLINE;
+			else
+			{
+				printf("Unknown fit model %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'E':
+			num_estimators = parse_estimators(optarg, estimators, SWEEP_MAX);
+			if (num_estimators < 0)
+			{
+				printf("Unknown estimator or too many in %s\n", optarg);
+				return -1;
+			}
+			break;
 		case 'b':
-			black_level = strtoul(optarg, NULL, 10);
+			num_black_levels = parse_list(optarg, black_levels, SWEEP_MAX);
+			if (num_black_levels < 0)
+			{
+				printf("Too many black levels\n");
+				return -1;
+			}
 			break;
 		case 'i':
-			in = open(optarg, O_RDONLY);
-			if (in < 0)
+			if (num_flats == MASTER_FRAMES_MAX)
 			{
-				printf("Failed to open %s\n", argv[1]);
+				printf("Too many input frames\n");
 				return -1;
 			}
+			flat_names[num_flats++] = optarg;
 			break;
 		case 'o':
 			out_frmt = strtoul(optarg, NULL, 10);
@@ -226,15 +4938,23 @@ int main(int argc, char *argv[])
 			}
 			break;
 		case 's':
-			block_size = strtoul(optarg, NULL, 10);
-			if (block_size<=0 || block_size>32)
+			num_block_sizes = parse_list(optarg, block_sizes, SWEEP_MAX);
+			if (num_block_sizes < 0)
 			{
-				printf("Analysis cell out of range\n");
+				printf("Too many analysis cell sizes\n");
 				return -1;
 			}
-			else if (block_size%2 == 1)
+			for (i=0; i<num_block_sizes; i++)
 			{
-				block_size++;
+				if (block_sizes[i]<=0 || block_sizes[i]>32)
+				{
+					printf("Analysis cell out of range\n");
+					return -1;
+				}
+				else if (block_sizes[i]%2 == 1)
+				{
+					block_sizes[i]++;
+				}
 			}
 			break;
 		default:
@@ -245,6 +4965,83 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if ((out_frmt&0x10) && !defect_threshold)
+	{
+		defect_threshold = DEFECT_THRESHOLD_DEFAULT;
+	}
+	if (num_threads < 1)
+		num_threads = 1;
+	if (num_block_sizes == 0)
+		block_sizes[num_block_sizes++] = 4;
+	if (num_estimators == 0)
+		estimators[num_estimators++] = EST_MEAN;
+	for (i=0; i<num_estimators; i++)
+	{
+		if (lowpass && estimators[i] != EST_MEAN)
+		{
+			printf("--lowpass can only be used with the mean estimator\n");
+			return -1;
+		}
+	}
+
+	//Several frames of either kind are median combined into a master frame,
+	//which is then analysed in their place
+	dark_fmt = raw_fmt;
+	if (stream.interval && (num_flats > 1 || num_darks))
+	{
+		printf("A stream is read from a single input, without dark frames\n");
+		return -1;
+	}
+	if (num_flats > 1 || (cache_dir && num_flats))
+	{
+		if (build_master(flat_names, num_flats, &raw_fmt, cache_dir, "flat", exposure_us,
+				num_threads, master_flat, sizeof(master_flat)))
+			return -1;
+		flat_names[0] = master_flat;
+		memset(&raw_fmt, 0, sizeof(raw_fmt));
+	}
+	if (num_darks > 1 || (cache_dir && num_darks))
+	{
+		if (build_master(dark_names, num_darks, &dark_fmt, cache_dir, "dark", exposure_us,
+				num_threads, master_dark, sizeof(master_dark)))
+			return -1;
+		dark_names[0] = master_dark;
+		memset(&dark_fmt, 0, sizeof(dark_fmt));
+	}
+	if (num_darks)
+		dark_name = dark_names[0];
+	if (num_flats)
+	{
+		in_name = flat_names[0];
+		in = open(in_name, O_RDONLY);
+		if (in < 0)
+		{
+			printf("Failed to open %s\n", in_name);
+			return -1;
+		}
+	}
+
+	table_opts.out_frmt = out_frmt;
+	table_opts.fit_model = fit_model;
+	table_opts.norm = norm;
+	table_opts.gain_fmt = gain_fmt;
+	table_opts.num_targets = num_targets;
+	memcpy(table_opts.targets, targets, sizeof(targets));
+	table_opts.num_modes = num_modes;
+	memcpy(table_opts.modes, modes, sizeof(modes));
+	table_opts.quality = quality;
+	table_opts.max_val = 0;
+	if (stream.interval)
+	{
+		//Frames are read as they come, from -i or stdin
+		if (lowpass || (out_frmt&0x18) || num_black_levels > 1 || num_block_sizes > 1 || num_estimators > 1)
+			printf("A stream is analysed with the first of each setting, without --lowpass, channel planes or defects\n");
+		i = run_stream(in, &raw_fmt, block_sizes[0], estimators[0], num_black_levels ? black_levels[0] : 0,
+				&stream, &table_opts, num_threads);
+		close(in);
+		return i;
+	}
+
 	fstat(in, &sb);
 	printf("File size is %ld\n", sb.st_size);
 
@@ -255,306 +5052,631 @@ int main(int argc, char *argv[])
 		goto close_file;
 	}
 
-	if (!memcmp(mmap_buf, "\xff\xd8", 2))
+	if (!raw_fmt.pixel_format && (size_t)sb.st_size >= strlen(BLOCK_SUMS_ID) &&
+			!memcmp(mmap_buf, BLOCK_SUMS_ID, strlen(BLOCK_SUMS_ID)))
 	{
-		int sensor_model = 1;
-		do
+		//The tables are made again from saved block sums, without the raw
+		struct sweep_combo sums_combo;
+
+		memset(&sums_combo, 0, sizeof(sums_combo));
+		if (!parse_block_sums((const char*)mmap_buf, sb.st_size, &img, &sums_combo, &grid_width, &grid_height))
 		{
-			in_buf = sensor_model_check(sensor_model, mmap_buf, sb.st_size);
+			table_opts.out_frmt &= ~0x40;
+			emit_tables(&sums_combo, 1, &table_opts, img.bayer_order, img.transform,
+					img.width, img.height, grid_width, grid_height);
+			status = 0;
 		}
-		while(in_buf == 0 && sensor_model++ <= 3);
-
-		if (in_buf == 0)
+		for (i=0; i<NUM_CHANNELS; i++)
 		{
-			in_buf = (uint8_t*)mmap_buf;
+			free(sums_combo.block_sum[i]);
+			free(sums_combo.block_count[i]);
 		}
+		goto unmap;
 	}
-	else
+	if (!raw_fmt.pixel_format && sb.st_size >= 4 && !memcmp(mmap_buf, "LSCP", 4))
 	{
-		in_buf = (uint8_t*)mmap_buf;
+		if (parse_lsc((uint8_t*)mmap_buf, sb.st_size, &img, &lsc))
+			goto unmap;
+		corrected_input = 1;
 	}
-
-	if (strncmp(in_buf, "BRCM", 4))
+	else if (!raw_fmt.pixel_format && (size_t)sb.st_size >= strlen(PLANE_SIDECAR_ID) &&
+			!memcmp(mmap_buf, PLANE_SIDECAR_ID, strlen(PLANE_SIDECAR_ID)))
 	{
-		printf("Raw file missing BRCM header\n");
-		goto unmap;
+		if (parse_plane_sidecar((const char*)mmap_buf, sb.st_size, in_name, &img, &planes))
+			goto unmap;
+		corrected_input = 1;
 	}
+	else if (parse_raw_file((uint8_t*)mmap_buf, sb.st_size, &raw_fmt, &img))
+		goto unmap;
 
-	char model[7];
-	memcpy(model, &in_buf[16], 6);
-	model[6] = '\0';
-	if (strncmp(model, "imx219", 6) == 0)
+	if (dark_name)
 	{
-		printf("Sensor type: %s\n", model);
-		if (black_level == 0)
+		//The dark frame is read as the flat field is, and must match it
+		struct stat dark_sb;
+
+		if (corrected_input)
 		{
-			black_level = 64;
+			printf("A dark frame needs a raw flat field, not channel planes\n");
+			goto unmap;
 		}
-	}
-	else if (strncmp(model, "ov5647", 6) == 0)
-	{
-		printf("Sensor type: %s\n", model);
-		if (black_level == 0)
+		dark_fd = open(dark_name, O_RDONLY);
+		if (dark_fd < 0 || fstat(dark_fd, &dark_sb))
+		{
+			printf("Failed to open %s\n", dark_name);
+			goto unmap;
+		}
+		dark_size = dark_sb.st_size;
+		dark_buf = mmap(NULL, dark_size, PROT_READ, MAP_PRIVATE, dark_fd, 0);
+		if (dark_buf == MAP_FAILED)
+		{
+			printf("mmap failed\n");
+			goto unmap;
+		}
+		printf("Dark frame %s:\n", dark_name);
+		if (parse_raw_file((uint8_t*)dark_buf, dark_size, &dark_fmt, &dark_img))
+			goto unmap;
+		if (dark_img.width != img.width || dark_img.height != img.height ||
+				dark_img.bayer_order != img.bayer_order || dark_img.max_val != img.max_val)
+		{
+			printf("The dark frame does not match the flat field\n");
+			goto unmap;
+		}
+		if (num_black_levels)
+			printf("Ignoring -b, the black level is measured from the dark frame\n");
+		//The mean of the dark frame stands as the black level
+		num_black_levels = 1;
+		black_levels[0] = measure_dark_level(&dark_img, num_threads);
+		printf("Black level measured from the dark frame: %u\n", black_levels[0]);
+		if (black_levels[0] >= dark_img.max_val)
 		{
-			black_level = 16;
+			printf("Dark frame level must be below the white level %u\n", dark_img.max_val);
+			black_levels[0] = dark_img.max_val - 1;
 		}
+		//The mean dark level is applied to the statistics of the raw values.
+		//Otherwise the dark frame itself replaces the black level correction.
+		if (raw_sums && dark_mode != DARK_LEVEL)
+			printf("Ignoring --raw-sums, the dark frame is subtracted per %s\n",
+					dark_mode == DARK_PIXEL ? "pixel" : "cell");
+		raw_sums = dark_mode == DARK_LEVEL;
 	}
-	else if (strncmp(model, "testc", 6) == 0 ||
-				strncmp(model, "imx477", 6) == 0)
+
+	if (img.model[0])
+	{
+		printf("Sensor type: %s\n", img.model);
+	}
+	if (corrected_input)
+	{
+		//The planes were saved with the black level already subtracted
+		if (num_black_levels)
+			printf("Ignoring -b, the channel planes are already black level corrected\n");
+		num_black_levels = 1;
+		black_levels[0] = 0;
+		printf("Black level: %d, already subtracted\n", img.black_level);
+	}
+	if (num_black_levels == 0)
+		black_levels[num_black_levels++] = 0;
+	for (j=0; j<num_black_levels && !corrected_input; j++)
 	{
-		printf("Sensor type: %s\n", model);
-		if (black_level == 0)
+		if (black_levels[j] == 0)
+		{
+			//Black level from the file, else the known value for the sensor
+			black_levels[j] = img.black_level;
+			if (black_levels[j] == 0)
+				black_levels[j] = sensor_black_level(img.model);
+			if (black_levels[j] == 0)
+				black_levels[j] = 16; // Default value
+		}
+		printf("Black level: %d\n", black_levels[j]);
+		if (black_levels[j] >= img.max_val)
 		{
-			black_level = 257;
+			printf("Black level must be below the white level %u\n", img.max_val);
+			goto unmap;
 		}
 	}
-	else if (black_level == 0)
+	if (img.data && exposure.check != EXPOSURE_OFF &&
+			check_exposure(&img, black_levels[0], &exposure) && exposure.check == EXPOSURE_ABORT)
+	{
+		printf("Not analysing the flat field\n");
+		check_failed = 1;
+		goto unmap;
+	}
+
+	//Black level correction is done by table lookup after unpacking
+	for (j=0; j<num_black_levels; j++)
 	{
-		black_level = 16; // Default value
+		black_lut[j] = (uint16_t *)malloc(packing_range(img.packing) * sizeof(uint16_t));
+		for (i=0; i<packing_range(img.packing); i++)
+			black_lut[j][i] = black_level_correct(i, black_levels[j], img.max_val);
 	}
-	printf("Black level: %d\n", black_level);
 
-	hdr = (struct brcm_raw_header*) (in_buf+0xB0);
-	printf("Header decoding: mode %s, width %u, height %u, padding %u %u\n",
-			hdr->name, hdr->width, hdr->height, hdr->padding_right, hdr->padding_down);
-	printf("transform %u, image format %u, bayer order %u, bayer format %u\n",
-			hdr->transform, hdr->format, hdr->bayer_order, hdr->bayer_format);
-	if (hdr->format != BRCM_FORMAT_BAYER ||
-			(hdr->bayer_format != BRCM_BAYER_RAW10 && hdr->bayer_format != BRCM_BAYER_RAW12))
+	//Every combination of black level, cell size and estimator is evaluated
+	//from the one decode, with the kernels for each selected once
+	combos_per_black = num_block_sizes * num_estimators;
+	num_combos = num_black_levels * combos_per_black;
+	combos = (struct sweep_combo *)calloc(num_combos, sizeof(struct sweep_combo));
+	for (k=0; k<num_combos; k++)
 	{
-		printf("Raw file is not Bayer raw10 or raw12\n");
-		goto unmap;
+		struct sweep_combo *combo = &combos[k];
+		combo->black_idx = k / combos_per_black;
+		combo->block_size = block_sizes[(k / num_estimators) % num_block_sizes];
+		combo->estimator = estimators[k % num_estimators];
+		combo->block_sums = lowpass ? NULL : select_block_sums(combo->block_size, combo->estimator);
 	}
-	bayer_order = hdr->bayer_order;
-	bits_per_sample = hdr->bayer_format * 2 + 4;
-	max_val = ( 1 << bits_per_sample ) - 1;
-	width = hdr->width;
-	height = hdr->height;
+	if (num_combos > 1)
+		printf("Sweeping %d combinations of settings\n", num_combos);
+
+	bayer_order = img.bayer_order;
+	max_val = img.max_val;
+	width = img.width;
+	height = img.height;
+	stride = img.stride;
 	single_channel_width = width/2;
 	single_channel_height = height/2;
 	grid_width = (single_channel_width + 31) / 32;
 	grid_height = (single_channel_height + 31) / 32;
-	block_px_max = block_size*block_size;
-	block_sum = (uint32_t *)malloc(sizeof(uint32_t) * grid_width * grid_height);
+	grid_cells = (size_t)grid_width * grid_height;
 	printf("Grid size: %d x %d\n", grid_width, grid_height);
 
-	if (bits_per_sample == 10) {
-		//Stride computed via same formula as the firmware uses.
-		stride = (((((width + hdr->padding_right)*5)+3)>>2) + 31)&(~31);
-	} else {
-		stride = (((((width + hdr->padding_right)*6)+3)>>2) + 31)&(~31);
+	for (k=0; k<num_combos; k++)
+	{
+		for (i=0; i<NUM_CHANNELS; i++)
+		{
+			combos[k].block_sum[i] = (uint32_t *)calloc(grid_cells, sizeof(uint32_t));
+			combos[k].block_count[i] = (uint32_t *)calloc(grid_cells, sizeof(uint32_t));
+			if (dark_name && dark_mode == DARK_CELL)
+			{
+				combos[k].dark_sum[i] = (uint32_t *)calloc(grid_cells, sizeof(uint32_t));
+				combos[k].dark_count[i] = (uint32_t *)calloc(grid_cells, sizeof(uint32_t));
+			}
+		}
 	}
+	jobs = (struct block_sums_job *)malloc(combos_per_black * NUM_CHANNELS * 2 * sizeof(struct block_sums_job));
 
-	for (i=0; i<NUM_CHANNELS; i++)
+	// The image is processed in strips of whole grid rows, so that each
+	// analysis window is contained in a single strip. Each strip carries
+	// an extra line above and below as neighbours for the defect detection.
+	// With several black levels, --raw-sums or a dark frame, the raw values
+	// are kept and the correction applied to a copy where it is needed.
+	// The statistics of the raw values are gathered with --raw-sums, and for
+	// a dark frame subtracted per cell.
+	raw_stats = raw_sums || (dark_name && dark_mode == DARK_CELL);
+
+	//The statistics for -o 128 are of the values the block sums are made from,
+	//where saturation is judged near the white level
+	for (k=0; k<num_combos && (out_frmt&0x80); k++)
 	{
-		out_buf[i] = (uint16_t*)malloc(single_channel_width*single_channel_height * sizeof(uint16_t));
-		memset(out_buf[i], 0, single_channel_width*single_channel_height * sizeof(uint16_t));
-	}
+		unsigned int black = corrected_input ? img.black_level : black_levels[combos[k].black_idx];
+		unsigned int sat_raw = max_val - max_val / SATURATION_MARGIN;
 
-	for (y=0; y<height; y++)
+		for (i=0; i<NUM_CHANNELS; i++)
+		{
+			struct cell_stats *stats = &combos[k].stats[i];
+
+			stats->sum = (uint32_t *)calloc(grid_cells, sizeof(uint32_t));
+			stats->sum_sq = (uint64_t *)calloc(grid_cells, sizeof(uint64_t));
+			stats->saturated = (uint32_t *)calloc(grid_cells, sizeof(uint32_t));
+			if (raw_stats)
+				stats->sat_level = sat_raw;
+			else if (dark_name && dark_mode == DARK_PIXEL)
+				stats->sat_level = sat_raw - black;	//Less the mean dark level
+			else
+				stats->sat_level = black_level_correct(sat_raw, black, max_val);
+		}
+	}
+	line_bytes = (size_t)single_channel_width * (sizeof(uint16_t) *
+			(1 + (num_black_levels > 1 || raw_sums || dark_name) + (dark_name ? 1 : 0)) +
+			(defect_threshold ? 1 : 0)) * NUM_CHANNELS;
+	if ((out_frmt&0x08) && plane_format == PLANE_PGM)
+		line_bytes += (size_t)single_channel_width * sizeof(uint16_t);
+	strip_rows = single_channel_height;
+	if (mem_limit)
 	{
-		uint8_t *line = in_buf + (y*stride) + 32768;
-		int chan_a, chan_b;
-		if (y&1)
+		size_t fixed = grid_cells * 2 * sizeof(uint32_t) * NUM_CHANNELS * num_combos *
+				(combos[0].dark_sum[0] ? 2 : 1) + 2 * line_bytes;
+		size_t bands = mem_limit > fixed ? (mem_limit - fixed) / (32 * line_bytes) : 0;
+
+		if (bands == 0)
 		{
-			chan_a = 2;
-			chan_b = 3;
+			printf("Memory limit too small, using strips of one grid row\n");
+			bands = 1;
 		}
-		else
+		if (bands < grid_height)
 		{
-			chan_a = 0;
-			chan_b = 1;
-		}
-
-		uint16_t *chan_a_line = out_buf[chan_a] + ((y>>1)*single_channel_width);
-		uint16_t *chan_b_line = out_buf[chan_b] + ((y>>1)*single_channel_width);
-		if (bits_per_sample == 10) {
-			for (x=0; x<width; x+=4)
-			{
-				uint8_t lsbs = line[4];
-				*(chan_a_line) = black_level_correct(((*line)<<2) + (lsbs>>6), black_level, max_val);
-				chan_a_line++;
-				lsbs<<=2;
-				line++;
-				*(chan_b_line) = black_level_correct(((*line)<<2) + (lsbs>>6), black_level, max_val);
-				chan_b_line++;
-				lsbs<<=2;
-				line++;
-				*(chan_a_line) = black_level_correct(((*line)<<2) + (lsbs>>6), black_level, max_val);
-				chan_a_line++;
-				lsbs<<=2;
-				line++;
-				*(chan_b_line) = black_level_correct(((*line)<<2) + (lsbs>>6), black_level, max_val);
-				chan_b_line++;
-				lsbs<<=2;
-				line++;
-				line++; //skip the LSBs
-			}
-		} else {
-			for (x=0; x<width; x+=4)
-			{
-				*(chan_a_line) = black_level_correct(((*line)<<4) + (line[ 2 ]>>4), black_level, max_val);
-				chan_a_line++;
-				line++;
-				*(chan_b_line) = black_level_correct(((*line)<<4) + (line[ 1 ]&0x0F), black_level, max_val);
-				chan_b_line++;
-				line+= 2;
-				*(chan_a_line) = black_level_correct(((*line)<<4) + (line[ 2 ]>>4), black_level, max_val);
-				chan_a_line++;
-				line++;
-				*(chan_b_line) = black_level_correct(((*line)<<4) + (line[ 1 ]&&0x0F), black_level, max_val);
-				chan_b_line++;
-				line+= 2;
-			}
+			strip_rows = bands * 32;
+			printf("Processing in strips of %d lines\n", strip_rows * 2);
 		}
 	}
 
-	if (out_frmt&0x01)
+	for (i=0; i<NUM_CHANNELS; i++)
 	{
-		header = fopen("ls_table.h", "wb");
+		strip_buf[i] = (uint16_t*)calloc((size_t)(strip_rows+2)*single_channel_width, sizeof(uint16_t));
+		if (num_black_levels > 1 || raw_sums || dark_name)
+			corr_buf[i] = (uint16_t*)calloc((size_t)(strip_rows+2)*single_channel_width, sizeof(uint16_t));
+		if (dark_name)
+			dark_strip_buf[i] = (uint16_t*)calloc((size_t)(strip_rows+2)*single_channel_width, sizeof(uint16_t));
+		if (defect_threshold)
+			defect_mask[i] = (uint8_t*)malloc((size_t)strip_rows*single_channel_width);
 	}
-	if (out_frmt&0x02)
+
+	//Channel planes, previews and the defect map are from the first black level
+	if ((out_frmt&0x08) && plane_format == PLANE_LSC)
 	{
-		bin =  fopen("ls.bin", "wb");
+		// Compressed planes, with the black level correction applied
+		uint8_t hdr[LSC_HEADER_SIZE];
+		struct iovec iov = { hdr, LSC_HEADER_SIZE };
+		struct stat out_sb;
+
+		//Truncating the mapped input would lose it and kill the analysis
+		if (!stat("channels.lsc", &out_sb) && out_sb.st_dev == sb.st_dev && out_sb.st_ino == sb.st_ino)
+		{
+			printf("Not writing channels.lsc over the input\n");
+			goto unmap;
+		}
+		lsc_header(&img, corrected_input ? img.black_level : black_levels[0], hdr);
+		lsc_fd = open("channels.lsc", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (lsc_fd < 0 || writev_all(lsc_fd, &iov, 1))
+		{
+			printf("Failed to write channels.lsc\n");
+			if (lsc_fd >= 0)
+				close(lsc_fd);
+			lsc_fd = -1;
+		}
 	}
-	if (out_frmt&0x04)
+	else if ((out_frmt&0x08) && plane_files_clash(&planes, plane_filenames[plane_format]))
 	{
-		table = fopen("ls_table.txt", "wb");
+		printf("Not writing the channel planes over the input planes\n");
 	}
-	if (out_frmt&0x01)
+	else if (out_frmt&0x08)
 	{
-		fprintf(header, "uint8_t ls_grid[] = {\n");
+		// Write out the raw data for analysis. The planes are written
+		// straight from the strip buffers, bypassing stdio buffering.
+		const char *const *filenames = plane_filenames[plane_format];
+
+		plane_hdr_len = plane_header(plane_format, single_channel_width, single_channel_height, max_val, plane_hdr);
+		for (i=0; i<NUM_CHANNELS; i++)
+		{
+			plane_fd[i] = open(filenames[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (plane_fd[i] < 0)
+				printf("Failed to open %s\n", filenames[i]);
+		}
+		//PGM samples are big endian, and are swapped in a copy of the strip
+		//so the values being analysed, which may be the input planes
+		//themselves, are left alone
+		if (plane_format == PLANE_PGM)
+		{
+			swap_buf = (uint16_t *)malloc((size_t)strip_rows*single_channel_width*sizeof(uint16_t));
+			if (!swap_buf)
+			{
+				printf("Not enough memory to write the channel planes\n");
+				goto unmap;
+			}
+		}
+		sidecar = 1;
 	}
-	if (out_frmt&0x02)
+	if (preview_factor)
 	{
-		uint32_t transform = hdr->transform;
-		fwrite(&transform, sizeof(uint32_t), 1, bin);
-		fwrite(&grid_width, sizeof(uint32_t), 1, bin);
-		fwrite(&grid_height, sizeof(uint32_t), 1, bin);
+		preview_width = single_channel_width / preview_factor;
+		preview_height = single_channel_height / preview_factor;
+		if (preview_width == 0 || preview_height == 0)
+		{
+			printf("Preview factor too large for the image, no preview written\n");
+			preview_factor = 0;
+		}
+		for (i=0; i<NUM_CHANNELS && preview_factor; i++)
+			preview_sum[i] = (uint32_t *)calloc((size_t)preview_width*preview_height, sizeof(uint32_t));
+	}
+	if (out_frmt&0x10)
+	{
+		defects = text_open("defects.txt");
 	}
+	plane_outputs = lsc_fd >= 0 || preview_factor;
 	for (i=0; i<NUM_CHANNELS; i++)
+		plane_outputs |= plane_fd[i] >= 0;
+
+	for (strip_y=0; strip_y<single_channel_height; strip_y+=strip_rows)
 	{
-		if (out_frmt&0x08)
-		{
-			// Write out the raw data for analysis
-			const char *filenames[NUM_CHANNELS] = {
-				"ch1.bin",
-				"ch2.bin",
-				"ch3.bin",
-				"ch4.bin"
-			};
-			out = fopen(filenames[i], "wb");
-			if (out)
-			{
-				fwrite(out_buf[i], (single_channel_width*single_channel_height)*sizeof(uint16_t), 1, out);
-				fclose(out);
-				out = NULL;
-			}
-		}
-
-		//Write out the lens shading table in the order RGGB
-		uint16_t *channel = out_buf[channel_ordering[bayer_order][i]];
-		int mid_value_avg = 0;
-		int count = 0;
-		uint16_t *line;
-		const char *channel_comments[4] = {
-			"R",
-			"Gr",
-			"Gb",
-			"B"
-		};
+		int rows = min_int(strip_rows, single_channel_height - strip_y);
+		int first = max_int(strip_y-1, 0);
+		int last = min_int(strip_y+rows+1, single_channel_height);
+		uint16_t *channel[NUM_CHANNELS], *dark_channel[NUM_CHANNELS];
 
-		// Calculate sum for each block
-		uint16_t block_idx = 0;
-		uint32_t max_blk_val = 0;
-		for (y=0; y<grid_height; y++)
+		for (i=0; i<NUM_CHANNELS; i++)
 		{
-			int y_start = y*32+16-block_size/2;
-			if (y_start >= single_channel_height)
-				y_start = single_channel_height-1;
-			int y_stop  = y_start+block_size;
-			if (y_stop > single_channel_height)
-				y_stop = single_channel_height;
+			channel[i] = strip_buf[i] + single_channel_width;
+			dark_channel[i] = dark_strip_buf[i] + single_channel_width;
+		}
 
-			for (x=0; x<grid_width; x++)
+		if (lsc.block)
+		{
+			uint16_t *first_line[NUM_CHANNELS];
+			for (i=0; i<NUM_CHANNELS; i++)
+				first_line[i] = channel[i] + (ptrdiff_t)(first-strip_y)*single_channel_width;
+			lsc_read_rows(&lsc, first_line, first, last, num_threads);
+		}
+		else if (planes.map[0])
+		{
+			//Little endian planes are used in place, big endian ones are
+			//swapped into the strip buffers
+			for (i=0; i<NUM_CHANNELS; i++)
 			{
-				int x_start = x*32+16-block_size/2;
-				if (x_start >= single_channel_width)
-					x_start = single_channel_width-1;
-				int x_stop  = x_start+block_size;
-				if (x_stop > single_channel_width)
-					x_stop = single_channel_width;
-
-				uint32_t block_val = 0;
-				uint16_t block_px = 0;
-
-				for (int y_px = y_start; y_px < y_stop; y_px++)
+				uint16_t *plane = (uint16_t *)(planes.map[i] + planes.offset);
+				if (planes.big_endian)
 				{
-					line = &channel[y_px*(single_channel_width)];
-					for (int x_px = x_start; x_px < x_stop; x_px++)
-					{
-						block_val += line[x_px];
-						block_px++;
-					}
+					uint16_t *first_line = channel[i] + (ptrdiff_t)(first-strip_y)*single_channel_width;
+					memcpy(first_line, plane + (size_t)first*single_channel_width,
+							(size_t)(last-first)*single_channel_width*sizeof(uint16_t));
+					swap_bytes16(first_line, (size_t)(last-first)*single_channel_width);
 				}
-				if (block_px < block_px_max)
-					block_val = block_val * block_px_max / block_px; // Scale sum in case of small edge blocks
-
-				block_sum[block_idx++] =  block_val ? block_val : 1;
-				if (block_val > max_blk_val)
-					max_blk_val = block_val;
+				else
+					channel[i] = plane + (size_t)strip_y*single_channel_width;
 			}
 		}
-
-		max_blk_val <<= 5;
-		if (out_frmt&0x01)
+		if (img.data)
 		{
-			fprintf(header, "//%s - Ch %d\n", channel_comments[i], channel_ordering[bayer_order][i]);
+			//The flat field and dark frame are decoded side by side
+			num_decodes = dark_name ? 2 : 1;
+			for (k=0; k<num_decodes; k++)
+			{
+				struct decode_job *job = &decode_jobs[k];
+
+				job->img = k ? &dark_img : &img;
+				job->black_lut = num_black_levels == 1 && !raw_sums && !dark_name ? black_lut[0] : NULL;
+				for (i=0; i<NUM_CHANNELS; i++)
+					job->channel[i] = k ? dark_channel[i] : channel[i];
+				job->strip_y = strip_y;
+				job->rows = rows;
+				job->first = first;
+				job->last = last;
+			}
+			run_jobs(run_decode, decode_jobs, sizeof(struct decode_job), num_decodes, num_threads);
 		}
 
-		// Calculate gain for each block
-		block_idx = 0;
-		for (y=0; y<grid_height; y++)
+		//With --raw-sums the statistics of the raw values serve every black
+		//level, and corrected values are only needed for the channel planes
+		for (j=0; j<(raw_sums ? 1 : num_black_levels); j++)
 		{
-			for (x=0; x<grid_width; x++)
+			uint16_t *corrected[NUM_CHANNELS], *analysed[NUM_CHANNELS];
+			int black = raw_stats ? black_levels[j] : 0;
+
+			for (i=0; i<NUM_CHANNELS; i++)
+			{
+				corrected[i] = channel[i];
+				if (dark_name && (dark_mode == DARK_PIXEL || plane_outputs))
+				{
+					//The channel planes are always the flat field less the dark frame
+					ptrdiff_t offset = (ptrdiff_t)(first-strip_y)*single_channel_width;
+					corrected[i] = corr_buf[i] + single_channel_width;
+					subtract_dark(channel[i] + offset, dark_channel[i] + offset, corrected[i] + offset,
+							(size_t)(last-first)*single_channel_width);
+				}
+				else if (num_black_levels > 1 || (raw_sums && plane_outputs))
+				{
+					ptrdiff_t offset = (ptrdiff_t)(first-strip_y)*single_channel_width;
+					corrected[i] = corr_buf[i] + single_channel_width;
+					apply_black_lut(channel[i] + offset, corrected[i] + offset,
+							(size_t)(last-first)*single_channel_width, black_lut[j]);
+				}
+				analysed[i] = raw_stats ? channel[i] : corrected[i];
+			}
+
+			if (defect_threshold)
 			{
-				int gain = max_blk_val / block_sum[block_idx++] + 0.5;
-				if (gain > 255)
-					gain = 255; //Clip as uint8_t
-				else if (gain < 32)
-					gain = 32;  //Clip at x1.0, should never happen
-				if (out_frmt&0x01)
+				//Ignore differences below the noise floor in dark areas
+				unsigned int noise_floor = (max_val >> 6) * (max_val - black) / max_val;
+				unsigned int found = 0;
+
+				for (i=0; i<NUM_CHANNELS; i++)
 				{
-					fprintf(header, "%d, ", gain);
+					found += detect_defects(analysed[i], defect_mask[i], single_channel_width,
+							strip_y, rows, single_channel_height, defect_threshold, noise_floor, black);
 				}
-				if (out_frmt&0x02)
+
+				if (j == 0)
+					num_defects += found;
+				if (defects && j == 0)
 				{
-					uint8_t gain_bin = gain;
-					fwrite(&gain_bin, sizeof(uint8_t), 1, bin);
+					//Coordinates are in sensor pixels
+					for (i=0; i<NUM_CHANNELS; i++)
+					{
+						for (y=0; y<rows; y++)
+						{
+							uint8_t *mask_line = defect_mask[i] + (size_t)y*single_channel_width;
+							for (x=0; x<single_channel_width; x++)
+							{
+								if (!mask_line[x])
+									continue;
+								text_uint(defects, x*2 + (i&1), " ");
+								text_uint(defects, (strip_y+y)*2 + (i>>1), " ");
+								text_uint(defects, i, "\n");
+							}
+						}
+					}
 				}
-				if (out_frmt&0x04)
+			}
+
+			// Calculate sum for each block, for every combination of
+			// settings with this black level, across the worker threads. A
+			// dark frame subtracted per cell has its sums made alongside.
+			num_jobs = combos_per_black*NUM_CHANNELS * (combos[0].dark_sum[0] ? 2 : 1);
+			for (k=0; k<num_jobs; k++)
+			{
+				struct sweep_combo *combo = &combos[j*combos_per_black + (k/NUM_CHANNELS) % combos_per_black];
+				struct block_sums_job *job = &jobs[k];
+				int dark = k >= combos_per_black*NUM_CHANNELS;
+
+				i = k % NUM_CHANNELS;
+				job->block_sums = combo->block_sums;
+				job->channel = dark ? dark_channel[i] : analysed[i];
+				job->mask = defect_mask[i];
+				job->width = single_channel_width;
+				job->height = single_channel_height;
+				job->y0 = strip_y;
+				job->rows = rows;
+				job->grid_width = grid_width;
+				job->block_size = combo->block_size;
+				job->block_sum = dark ? combo->dark_sum[i] : combo->block_sum[i];
+				job->block_count = dark ? combo->dark_count[i] : combo->block_count[i];
+				job->stats = dark || !combo->stats[i].sum ? NULL : &combo->stats[i];
+			}
+			run_jobs(run_block_sums, jobs, sizeof(struct block_sums_job), num_jobs, num_threads);
+
+			if (j > 0)
+				continue;
+
+			for (i=0; i<NUM_CHANNELS; i++)
+			{
+				if (preview_sum[i])
+					accumulate_preview(corrected[i], single_channel_width, strip_y, rows,
+							preview_factor, preview_width, preview_height, preview_sum[i]);
+
+				if (plane_fd[i] >= 0)
 				{
-					fprintf(table, "%d %d %d %d\n", x * 32 + 16, y * 32 + 16, gain, i);
+					//The header goes out with the first strip
+					struct iovec iov[2] = {
+						{ plane_hdr, strip_y ? 0 : plane_hdr_len },
+						{ corrected[i], (size_t)rows*single_channel_width*sizeof(uint16_t) }
+					};
+					if (swap_buf)
+					{
+						memcpy(swap_buf, corrected[i], iov[1].iov_len);
+						swap_bytes16(swap_buf, (size_t)rows*single_channel_width);
+						iov[1].iov_base = swap_buf;
+					}
+					if (writev_all(plane_fd[i], iov, 2))
+					{
+						printf("Failed to write channel %d data\n", i+1);
+						close(plane_fd[i]);
+						plane_fd[i] = -1;
+					}
 				}
 			}
+
+			if (lsc_fd >= 0 && lsc_write_strip(lsc_fd, corrected, single_channel_width, rows,
+						sample_bits(max_val), num_threads))
+			{
+				printf("Failed to write channels.lsc\n");
+				close(lsc_fd);
+				lsc_fd = -1;
+			}
 		}
 
+		if (strip_rows < single_channel_height && img.data)
+		{
+			//Release the raw data that has been processed
+			size_t done = (size_t)(img.data - (uint8_t*)mmap_buf) + (size_t)(last*2-2)*stride;
+			madvise(mmap_buf, done & ~((size_t)sysconf(_SC_PAGESIZE)-1), MADV_DONTNEED);
+			if (dark_name)
+			{
+				done = (size_t)(dark_img.data - (uint8_t*)dark_buf) + (size_t)(last*2-2)*dark_img.stride;
+				madvise(dark_buf, done & ~((size_t)sysconf(_SC_PAGESIZE)-1), MADV_DONTNEED);
+			}
+		}
 	}
-	if (out_frmt&0x01)
+
+	if (preview_sum[0] && preview_csv)
+		write_heatmap("heatmap.csv", preview_sum, channel_ordering[bayer_order],
+				preview_width, preview_height, preview_factor);
+	if (sidecar)
+		write_plane_sidecar("channels.txt", &img, corrected_input ? img.black_level : black_levels[0], plane_format);
+
+	for (i=0; i<NUM_CHANNELS; i++)
 	{
-		fprintf(header, "};\n");
-		fprintf(header, "uint32_t ref_transform = %u;\n", hdr->transform);
-		fprintf(header, "uint32_t grid_width = %u;\n", grid_width);
-		fprintf(header, "uint32_t grid_height = %u;\n", grid_height);
+		if (plane_fd[i] >= 0)
+			close(plane_fd[i]);
+		if (preview_sum[i] && !preview_csv)
+		{
+			char filename[32];
+			sprintf(filename, "ch%d_preview.pgm", i+1);
+			write_preview(filename, preview_sum[i], preview_width, preview_height,
+					preview_factor, max_val);
+		}
+		//Backwards, so the sums shared from the first black level are copied
+		//before they are corrected
+		for (k=num_combos-1; k>=0; k--)
+		{
+			struct sweep_combo *combo = &combos[k];
+			if (raw_sums && combo->black_idx)
+			{
+				//Share the statistics of the raw values between the black levels
+				memcpy(combo->block_sum[i], combos[k - combo->black_idx*combos_per_black].block_sum[i],
+						grid_cells * sizeof(uint32_t));
+				memcpy(combo->block_count[i], combos[k - combo->black_idx*combos_per_black].block_count[i],
+						grid_cells * sizeof(uint32_t));
+				if (combo->stats[i].sum)
+				{
+					const struct cell_stats *shared = &combos[k - combo->black_idx*combos_per_black].stats[i];
+					memcpy(combo->stats[i].sum, shared->sum, grid_cells * sizeof(uint32_t));
+					memcpy(combo->stats[i].sum_sq, shared->sum_sq, grid_cells * sizeof(uint64_t));
+					memcpy(combo->stats[i].saturated, shared->saturated, grid_cells * sizeof(uint32_t));
+				}
+			}
+			if (lowpass)
+				scale_cell_sums(combo->block_sum[i], combo->block_count[i], grid_cells, combo->block_size);
+			if (lowpass && combo->dark_sum[i])
+				scale_cell_sums(combo->dark_sum[i], combo->dark_count[i], grid_cells, combo->block_size);
+			if (raw_sums)
+				black_correct_block_sums(combo->block_sum[i], grid_cells, combo->block_size,
+						black_levels[combo->black_idx], max_val);
+			if (combo->dark_sum[i])
+				dark_correct_block_sums(combo->block_sum[i], combo->dark_sum[i], grid_cells,
+						black_levels[0], max_val);
+		}
 	}
+	if (lsc_fd >= 0)
+		close(lsc_fd);
+	if (defects && text_close(defects))
+		printf("Failed to write defects.txt\n");
+	if (defect_threshold)
+		printf("Defective pixels: %u\n", num_defects);
 
+	for (k=0; k<num_combos; k++)
+	{
+		combos[k].black_level = corrected_input ? img.black_level : black_levels[combos[k].black_idx];
+		//Raw values are rescaled to the white level with the black correction
+		combos[k].stats_scale = raw_stats ? (double)max_val / (max_val - combos[k].black_level) : 1.0;
+	}
+	table_opts.max_val = max_val;
+	check_failed = emit_tables(combos, num_combos, &table_opts, bayer_order, img.transform,
+			single_channel_width, single_channel_height, grid_width, grid_height);
+	status = 0;
 	for (i=0; i<NUM_CHANNELS; i++)
 	{
-		 free(out_buf[i]);
+		 free(strip_buf[i]);
+		 free(corr_buf[i]);
+		 free(dark_strip_buf[i]);
+		 free(defect_mask[i]);
+		 free(preview_sum[i]);
+		 for (k=0; k<num_combos; k++)
+		 {
+			 free(combos[k].block_sum[i]);
+			 free(combos[k].block_count[i]);
+			 free(combos[k].dark_sum[i]);
+			 free(combos[k].dark_count[i]);
+			 free(combos[k].stats[i].sum);
+			 free(combos[k].stats[i].sum_sq);
+			 free(combos[k].stats[i].saturated);
+		 }
 	}
+	free(combos);
+	free(jobs);
+	free(swap_buf);
+	for (j=0; j<num_black_levels; j++)
+		free(black_lut[j]);
+	free(lsc.block);
+	free(lsc.block_size);
 unmap:
+	for (i=0; i<NUM_CHANNELS; i++)
+	{
+		if (planes.map[i])
+			munmap(planes.map[i], planes.map_size[i]);
+	}
+	if (dark_buf != MAP_FAILED)
+		munmap(dark_buf, dark_size);
+	if (dark_fd >= 0)
+		close(dark_fd);
 	munmap(mmap_buf, sb.st_size);
 close_file:
 	close(in);
-	return 0;
+	//A capture that fails the check is flagged to scripts, apart from errors
+	return check_failed ? 2 : status;
 }
@@ -0,0 +1,526 @@
+/*
+Copyright (c) 2017, Raspberry Pi (Trading) Ltd
+Copyright (c) 2017, Dave Stevenson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file gen_raw
+ *
+ * Generates synthetic BRCM headed raw files for the regression tests. The
+ * same image can also be written as a DNG, or as a headerless CSI-2 packed
+ * or unpacked 16 bit buffer as libcamera delivers them, or PiSP compressed.
+ *
+ * The image is a flat field with radial fall off and a different level for
+ * each colour, plus pseudo random noise and a few hot and dead pixels, or a
+ * dark frame with just the noise and defects. Either can have a horizontal
+ * ramp in the black level, as amplifier glow gives, and a DNG can have
+ * optically masked lines above the active area. A stream of several frames
+ * has fresh noise in each, and can change its fall off from frame to frame. Only
+ * integer arithmetic and a fixed LCG are used, so the output is identical
+ * on every platform.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+//Must match struct brcm_raw_header in lens_shading_analyse.c
+#define HEADER_SIZE    32768
+#define HEADER_OFFSET  0xB0
+
+static uint32_t lcg_state;
+
+static uint32_t lcg_next(void)
+{
+	lcg_state = lcg_state * 1664525 + 1013904223;
+	return lcg_state >> 16;
+}
+
+enum output_format {
+	FORMAT_BRCM,
+	FORMAT_DNG,
+	FORMAT_CSI2P,	//BRCM data without the header
+	FORMAT_RAW16,	//Unpacked 16 bit little endian, padding_right pixels at the end of each line
+	FORMAT_PISP	//PiSP compressed, padding_right pixels at the end of each line
+};
+
+static int big_endian;
+
+static void put16(uint8_t *p, uint16_t val)
+{
+	if (big_endian)
+	{
+		p[0] = val >> 8;
+		p[1] = val & 0xFF;
+	}
+	else
+	{
+		p[0] = val & 0xFF;
+		p[1] = val >> 8;
+	}
+}
+
+static void put32(uint8_t *p, uint32_t val)
+{
+	if (big_endian)
+	{
+		put16(p, val >> 16);
+		put16(p+2, val & 0xFFFF);
+	}
+	else
+	{
+		put16(p, val & 0xFFFF);
+		put16(p+2, val >> 16);
+	}
+}
+
+//Append a TIFF IFD entry. Values of up to 4 bytes are stored in the entry,
+//with a pair of SHORTs passed as the high and low halves of value.
+static uint8_t *put_entry(uint8_t *p, uint16_t tag, uint16_t type, uint32_t count, uint32_t value)
+{
+	put16(p, tag);
+	put16(p+2, type);
+	put32(p+4, count);
+	if (type == 3 && count == 1)
+		put16(p+8, value);
+	else if (type == 3 && count == 2)
+	{
+		put16(p+8, value >> 16);
+		put16(p+10, value & 0xFFFF);
+	}
+	else if (type == 1 && count <= 4)
+		memcpy(p+8, &value, 4);
+	else
+		put32(p+8, value);
+	return p + 12;
+}
+
+// Wrap the 16 bit image in a minimal DNG: IFD0 for the camera details, with
+// a SubIFD holding the CFA image in strips of 16 lines, as libcamera writes.
+// The first masked lines of the image are optical black, outside the active
+// area, and bayer_order is that of the whole image.
+static uint8_t *make_dng(uint16_t *image, int width, int height, int bayer_order,
+		int max_val, int black_level, const char *model, int masked, size_t *size)
+{
+	static const uint8_t patterns[4][4] = {
+		{ 0, 1, 1, 2 },
+		{ 1, 2, 0, 1 },
+		{ 2, 1, 1, 0 },
+		{ 1, 0, 2, 1 }
+	};
+	const int rows_per_strip = 16;
+	int strips = (height + rows_per_strip - 1) / rows_per_strip;
+	size_t ifd0 = 8, sub_ifd = 256, arrays = 512;
+	size_t black_array = sub_ifd + (masked ? 212 : 208);
+	size_t data = arrays + strips*8 + 256;
+	uint8_t *buf, *p;
+	uint32_t cfa;
+	int i;
+
+	*size = data + (size_t)width*height*2;
+	buf = calloc(*size, 1);
+
+	memcpy(buf, big_endian ? "MM\0*" : "II*\0", 4);
+	put32(buf+4, ifd0);
+
+	p = buf + ifd0;
+	put16(p, 4);
+	p = put_entry(p+2, 254, 4, 1, 1);	//NewSubFileType, reduced resolution
+	p = put_entry(p, 272, 2, strlen(model)+1, arrays + strips*8);	//Model
+	p = put_entry(p, 330, 4, 1, sub_ifd);	//SubIFDs
+	p = put_entry(p, 50706, 1, 4, 0x00000401);	//DNGVersion 1.4
+	put32(p, 0);
+	strcpy((char *)buf + arrays + strips*8, model);
+
+	memcpy(&cfa, patterns[bayer_order], 4);
+	p = buf + sub_ifd;
+	put16(p, masked ? 17 : 15);
+	p = put_entry(p+2, 254, 4, 1, 0);	//NewSubFileType, main image
+	p = put_entry(p, 256, 4, 1, width);
+	p = put_entry(p, 257, 4, 1, height);
+	p = put_entry(p, 258, 3, 1, 16);
+	p = put_entry(p, 259, 3, 1, 1);	//No compression
+	p = put_entry(p, 262, 3, 1, 32803);	//CFA
+	p = put_entry(p, 273, 4, strips, arrays);	//StripOffsets
+	p = put_entry(p, 277, 3, 1, 1);
+	p = put_entry(p, 278, 4, 1, rows_per_strip);
+	p = put_entry(p, 279, 4, strips, arrays + strips*4);	//StripByteCounts
+	p = put_entry(p, 284, 3, 1, 1);
+	p = put_entry(p, 33421, 3, 2, (2 << 16) | 2);	//CFARepeatPatternDim
+	p = put_entry(p, 33422, 1, 4, cfa);	//CFAPattern
+	p = put_entry(p, 50714, 4, 4, black_array);	//BlackLevel, per channel
+	p = put_entry(p, 50717, 4, 1, max_val);	//WhiteLevel
+	if (masked)
+	{
+		p = put_entry(p, 50829, 3, 4, black_array + 16);	//ActiveArea
+		p = put_entry(p, 50830, 3, 4, black_array + 24);	//MaskedAreas
+	}
+	put32(p, 0);
+	for (i=0; i<4; i++)
+		put32(buf + black_array + i*4, black_level);
+	if (masked)
+	{
+		//ActiveArea then MaskedAreas, each as top, left, bottom, right
+		const uint16_t areas[8] = { masked, 0, height, width, 0, 0, masked, width };
+		for (i=0; i<8; i++)
+			put16(buf + black_array + 16 + i*2, areas[i]);
+	}
+
+	for (i=0; i<strips; i++)
+	{
+		int rows = height - i*rows_per_strip < rows_per_strip ? height - i*rows_per_strip : rows_per_strip;
+		put32(buf + arrays + i*4, data + (size_t)i*rows_per_strip*width*2);
+		put32(buf + arrays + strips*4 + i*4, rows*width*2);
+	}
+	for (i=0; i<width*height; i++)
+		put16(buf + data + (size_t)i*2, image[i]);
+
+	return buf;
+}
+
+//PiSP compression as the front end does it with offset 2048. Only modes 2 and
+//3 are used, which between them cover the whole 16 bit range.
+#define PISP_COMPRESS_OFFSET 2048
+
+static int pisp_quantise_mode3(int v)
+{
+	int q = (v + 128) / 256;
+	if (q >= 94)
+		q = (v + 256) / 512 + 47;
+	return q > 175 ? 175 : q;
+}
+
+// Encode 4 values of one colour into a 32 bit word. Mode 2 is used where the
+// values are close enough together for its delta coding, else mode 3.
+static uint32_t pisp_encode_word(const int *v)
+{
+	int q[4], i;
+	int field0, field1, p1, p2;
+
+	for (i=0; i<4; i++)
+	{
+		int val = v[i] - PISP_COMPRESS_OFFSET;
+		q[i] = val < 0 ? 0 : (val + 64) / 128;
+		if (q[i] > 511)
+			q[i] = 511;
+	}
+
+	field0 = -1;
+	field1 = 0;
+	if (q[1] >= 384 && q[2] >= 384 && q[2] - 384 <= 127)
+	{
+		field0 = q[1];
+		field1 = q[2] - 384;
+	}
+	else if (q[2] >= q[1] && q[2] - q[1] <= 63 && q[1] < 384)
+	{
+		field0 = q[1];
+		field1 = 64 + q[2] - q[1];
+	}
+	else if (q[1] > q[2] && q[1] - q[2] <= 64 && q[2] < 384)
+	{
+		field0 = q[2];
+		field1 = 64 - (q[1] - q[2]);
+	}
+	p1 = q[1] - 64 < 0 ? 0 : q[1] - 64 > 384 ? 384 : q[1] - 64;
+	p2 = q[2] - 64 < 0 ? 0 : q[2] - 64 > 384 ? 384 : q[2] - 64;
+	if (field0 >= 0 && q[0] >= p1 && q[0] - p1 <= 127 && q[3] >= p2 && q[3] - p2 <= 127)
+		return 2 | (field0 << 2) | (field1 << 11) | ((q[0] - p1) << 18) | ((uint32_t)(q[3] - p2) << 25);
+
+	for (i=0; i<4; i++)
+	{
+		int val = v[i] - PISP_COMPRESS_OFFSET;
+		q[i] = pisp_quantise_mode3(val < 0 ? 0 : val);
+	}
+	return 3 | ((uint32_t)(((176 * (q[0] >> 4) + q[1]) << 4) | (q[0] & 15)) << 2) |
+			((uint32_t)(((176 * (q[2] >> 4) + q[3]) << 4) | (q[2] & 15)) << 17);
+}
+
+void print_help(void)
+{
+	printf("usage: gen_raw -o <output> [-f brcm|dng|dng-be|csi2p|raw16|pisp] [-r seed] [-b black] [-d] [-a glow] [-m masked lines] [-n frames] [-v fall off step] <width> <height> <bits> <bayer order> <padding right> <model>\n");
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *out;
+	uint8_t *buf;
+	uint16_t *line, *image = NULL;
+	const char *filename = NULL, *model;
+	int width, height, bits, bayer_order, padding_right, stride;
+	int max_val, nominal_black, black_level = 0, dark = 0, glow = 0, masked = 0, frames = 1;
+	int fall_off = 600, fall_off_step = 0, frame, csi_stride;
+	int64_t cx, cy, r2_max;
+	enum output_format format = FORMAT_BRCM;
+	size_t size;
+	int x, y, opt;
+
+	lcg_state = 1;
+	while ((opt = getopt(argc, argv, "a:b:df:m:n:o:r:v:")) != -1)
+	{
+		switch (opt) {
+		case 'f':
+			if (!strncmp(optarg, "dng", 3))
+				format = FORMAT_DNG;
+			else if (!strcmp(optarg, "csi2p"))
+				format = FORMAT_CSI2P;
+			else if (!strcmp(optarg, "raw16"))
+				format = FORMAT_RAW16;
+			else if (!strcmp(optarg, "pisp"))
+				format = FORMAT_PISP;
+			big_endian = !strcmp(optarg, "dng-be");
+			break;
+		case 'o':
+			filename = optarg;
+			break;
+		case 'r':
+			lcg_state = strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			glow = atoi(optarg);
+			break;
+		case 'b':
+			black_level = atoi(optarg);
+			break;
+		case 'd':
+			dark = 1;
+			break;
+		case 'm':
+			masked = atoi(optarg);
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 'v':
+			fall_off_step = atoi(optarg);
+			break;
+		default:
+			print_help();
+			return -1;
+		}
+	}
+
+	if (!filename || argc - optind < 6)
+	{
+		print_help();
+		return -1;
+	}
+
+	width = atoi(argv[optind]);
+	height = atoi(argv[optind+1]);
+	bits = atoi(argv[optind+2]);
+	bayer_order = atoi(argv[optind+3]);
+	padding_right = atoi(argv[optind+4]);
+	model = argv[optind+5];
+	if ((bits != 10 && bits != 12) || bayer_order < 0 || bayer_order > 3 || width & 1 || height & 1)
+	{
+		print_help();
+		return -1;
+	}
+
+	//Stride computed via same formula as the firmware uses.
+	csi_stride = (((((width + padding_right)*(bits == 10 ? 5 : 6))+3)>>2) + 31)&(~31);
+	//Zeroed slack for a partial group of pixels at the end of the line
+	line = calloc(width + 8, sizeof(uint16_t));
+
+	max_val = (1 << bits) - 1;
+	//A DNG is tagged with the nominal black level, which the pixels can differ from
+	nominal_black = bits == 10 ? 64 : 256;
+	if (!black_level)
+		black_level = nominal_black;
+	cx = width / 2;
+	cy = height / 2;
+	r2_max = cx*cx + cy*cy;
+
+	out = fopen(filename, "wb");
+	if (!out)
+	{
+		printf("Failed to open %s\n", filename);
+		return -1;
+	}
+
+	//Each frame of a stream has its own noise
+	for (frame=0; frame<frames; frame++)
+	{
+		stride = csi_stride;
+		size = HEADER_SIZE + (size_t)stride*height;
+		buf = calloc(size, 1);
+		if (format == FORMAT_PISP)
+		{
+			stride = (width + padding_right + 7) & ~7;
+			free(buf);
+			size = (size_t)stride*height;
+			buf = calloc(size, 1);
+		}
+		if (format == FORMAT_DNG || format == FORMAT_RAW16)
+			image = calloc((size_t)(width+padding_right)*(height+masked), sizeof(uint16_t));
+
+		if (format != FORMAT_PISP)
+		{
+			memcpy(buf, "BRCM", 4);
+			strncpy((char *)&buf[16], model, 6);
+			strcpy((char *)&buf[HEADER_OFFSET], "synthetic");
+			put16(&buf[HEADER_OFFSET+32], width);
+			put16(&buf[HEADER_OFFSET+34], height);
+			put16(&buf[HEADER_OFFSET+36], padding_right);
+			put16(&buf[HEADER_OFFSET+38], 0);
+			put16(&buf[HEADER_OFFSET+64], 0);	//transform
+			put16(&buf[HEADER_OFFSET+66], 33);	//BRCM_FORMAT_BAYER
+			buf[HEADER_OFFSET+68] = bayer_order;
+			buf[HEADER_OFFSET+69] = bits == 10 ? 3 : 4;
+		}
+
+		//Optical black lines, only in a DNG
+		if (format == FORMAT_DNG)
+		{
+			for (y=0; y<masked; y++)
+			{
+				for (x=0; x<width; x++)
+					image[(size_t)y*width + x] = black_level + glow*x/width + (int)(lcg_next() % 17) - 8;
+			}
+		}
+
+		for (y=0; y<height; y++)
+		{
+			uint8_t *dst = buf + (format == FORMAT_PISP ? 0 : HEADER_SIZE) + (size_t)y*stride;
+
+			for (x=0; x<width; x++)
+			{
+				//Position in the 2x2 pattern, and its colour (0 R, 1 G, 2 B)
+				static const int colours[4][4] = {
+					{ 0, 1, 1, 2 },
+					{ 1, 2, 0, 1 },
+					{ 2, 1, 1, 0 },
+					{ 1, 0, 2, 1 }
+				};
+				static const int colour_level[3] = { 700, 1000, 600 };
+				int colour = colours[bayer_order][(y&1)*2 + (x&1)];
+				int64_t r2 = ((x-cx)*(x-cx) + (y-cy)*(y-cy)) * 1024 / r2_max;
+				int64_t level = (int64_t)(max_val - black_level) * colour_level[colour] / 1000;
+				int val;
+
+				//Fall off to about 40% in the corners
+				level = level * (1024*1024 - fall_off*r2 + 20*r2*r2/1024) / (1024*1024);
+				if (dark)
+					level = 0;
+				val = black_level + glow*x/width + level + (int)(lcg_next() % 17) - 8;
+
+				//Hot and dead pixels at fixed positions
+				if ((x == width/2 && y == height/2) || (x == 35 && y == 33))
+					val = max_val;
+				else if (x == width/4 && y == height/3)
+					val = 0;
+
+				line[x] = val < 0 ? 0 : val > max_val ? max_val : val;
+			}
+
+			if (format == FORMAT_DNG)
+			{
+				memcpy(image + (size_t)(y+masked)*width, line, width * sizeof(uint16_t));
+				continue;
+			}
+			else if (format == FORMAT_RAW16)
+			{
+				memcpy(image + (size_t)y*(width+padding_right), line, width * sizeof(uint16_t));
+				continue;
+			}
+			else if (format == FORMAT_PISP)
+			{
+				//Scaled up to 16 bits, even pixels then odd pixels of each 8
+				for (x=0; x<width; x+=8)
+				{
+					int even[4], odd[4], i;
+					for (i=0; i<4; i++)
+					{
+						even[i] = line[x+i*2] << (16 - bits);
+						odd[i] = line[x+i*2+1] << (16 - bits);
+					}
+					put32(dst, pisp_encode_word(even));
+					put32(dst+4, pisp_encode_word(odd));
+					dst += 8;
+				}
+				continue;
+			}
+
+			if (bits == 10)
+			{
+				for (x=0; x<width; x+=4)
+				{
+					dst[0] = line[x] >> 2;
+					dst[1] = line[x+1] >> 2;
+					dst[2] = line[x+2] >> 2;
+					dst[3] = line[x+3] >> 2;
+					dst[4] = (line[x] & 3) | ((line[x+1] & 3) << 2) |
+							((line[x+2] & 3) << 4) | ((line[x+3] & 3) << 6);
+					dst += 5;
+				}
+			}
+			else
+			{
+				for (x=0; x<width; x+=2)
+				{
+					dst[0] = line[x] >> 4;
+					dst[1] = line[x+1] >> 4;
+					dst[2] = (line[x] & 0x0F) | ((line[x+1] & 0x0F) << 4);
+					dst += 3;
+				}
+			}
+		}
+
+		if (format == FORMAT_DNG)
+		{
+			//Lines above the active area change the pattern of the whole image
+			static const int vflip[4] = { 1, 0, 3, 2 };
+			free(buf);
+			buf = make_dng(image, width, height+masked, masked & 1 ? vflip[bayer_order] : bayer_order,
+					max_val, nominal_black, model, masked, &size);
+			free(image);
+		}
+		else if (format == FORMAT_RAW16)
+		{
+			free(buf);
+			size = (size_t)(width+padding_right)*height*2;
+			buf = malloc(size);
+			for (x=0; x<(width+padding_right)*height; x++)
+				put16(buf + (size_t)x*2, image[x]);
+			free(image);
+		}
+		else if (format == FORMAT_CSI2P)
+		{
+			size -= HEADER_SIZE;
+			memmove(buf, buf + HEADER_SIZE, size);
+		}
+		fwrite(buf, size, 1, out);
+		free(buf);
+		fall_off += fall_off_step;
+	}
+	fclose(out);
+
+	free(line);
+	return 0;
+}
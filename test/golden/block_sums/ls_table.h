@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 0
+60, 49, 43, 40, 38, 38, 39, 41, 46, 54, 52, 44, 39, 36, 35, 35, 35, 37, 41, 48, 48, 41, 37, 34, 33, 33, 33, 35, 39, 45, 47, 40, 36, 33, 32, 32, 33, 35, 38, 43, 47, 40, 36, 34, 32, 32, 33, 35, 38, 44, 50, 42, 38, 35, 34, 33, 34, 36, 40, 46, 55, 46, 41, 38, 36, 36, 37, 39, 43, 50, 62, 50, 44, 41, 39, 39, 40, 42, 47, 56, //Gr - Ch 1
+58, 48, 42, 39, 37, 37, 38, 41, 46, 54, 51, 43, 38, 36, 34, 34, 35, 37, 41, 48, 47, 40, 36, 34, 32, 32, 33, 35, 39, 45, 46, 39, 35, 33, 32, 32, 32, 34, 38, 43, 46, 39, 35, 33, 32, 32, 33, 35, 38, 44, 49, 41, 37, 34, 33, 33, 34, 36, 40, 46, 54, 45, 40, 37, 36, 35, 36, 39, 43, 51, 60, 49, 43, 40, 38, 38, 39, 42, 47, 56, //Gb - Ch 2
+58, 48, 42, 39, 37, 37, 38, 41, 46, 54, 51, 43, 38, 35, 34, 34, 35, 37, 41, 48, 47, 40, 36, 34, 32, 32, 33, 35, 39, 45, 46, 39, 35, 33, 32, 32, 32, 34, 38, 43, 46, 39, 35, 33, 32, 32, 33, 34, 38, 44, 49, 41, 37, 34, 33, 33, 34, 36, 40, 46, 54, 45, 40, 37, 36, 35, 36, 39, 43, 51, 61, 50, 44, 40, 39, 38, 39, 42, 47, 56, //B - Ch 3
+59, 49, 43, 40, 38, 38, 39, 41, 46, 53, 52, 44, 39, 36, 35, 34, 35, 37, 41, 47, 48, 41, 37, 34, 33, 33, 33, 35, 39, 44, 47, 40, 36, 33, 32, 32, 33, 35, 38, 43, 47, 40, 36, 34, 32, 32, 33, 35, 38, 43, 50, 42, 38, 35, 34, 33, 34, 36, 40, 46, 55, 46, 41, 38, 36, 36, 37, 39, 43, 50, 62, 51, 44, 41, 39, 39, 40, 42, 47, 56, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 8;
@@ -0,0 +1,20 @@
+uint8_t ls_luma_grid[] = {
+58, 48, 42, 39, 38, 38, 39, 42, 48, 58, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 45, 39, 35, 33, 32, 32, 33, 35, 39, 45, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 48, 41, 37, 35, 33, 33, 35, 37, 41, 48, 54, 45, 40, 37, 36, 36, 37, 40, 45, 53, 63, 52, 45, 42, 40, 40, 42, 45, 52, 63, 
+};
+uint8_t ls_cr_grid[] = {
+32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 
+};
+uint8_t ls_cb_grid[] = {
+32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 
+};
+//R/G in units of 1/4096
+uint16_t ls_cr_ratio[] = {
+2892, 2878, 2874, 2872, 2871, 2870, 2869, 2867, 2867, 2877, 2880, 2874, 2872, 2871, 2870, 2869, 2868, 2866, 2865, 2866, 2875, 2872, 2871, 2869, 2868, 2867, 2866, 2865, 2863, 2862, 2873, 2871, 2869, 2868, 2866, 2865, 2865, 2864, 2862, 2861, 2871, 2869, 2868, 2867, 2865, 2864, 2864, 2863, 2861, 2859, 2871, 2868, 2867, 2866, 2865, 2864, 2863, 2861, 2859, 2858, 2874, 2867, 2865, 2865, 2864, 2863, 2861, 2859, 2857, 2860, 2889, 2869, 2864, 2862, 2861, 2860, 2859, 2857, 2858, 2872, 
+};
+//B/G in units of 1/4096
+uint16_t ls_cb_ratio[] = {
+2447, 2449, 2450, 2451, 2452, 2453, 2454, 2455, 2456, 2457, 2449, 2450, 2451, 2452, 2453, 2454, 2455, 2455, 2457, 2459, 2450, 2451, 2452, 2454, 2455, 2455, 2456, 2456, 2457, 2459, 2451, 2452, 2453, 2455, 2456, 2456, 2457, 2457, 2458, 2460, 2452, 2453, 2454, 2455, 2456, 2457, 2457, 2458, 2459, 2461, 2454, 2454, 2455, 2455, 2456, 2457, 2458, 2458, 2460, 2463, 2454, 2455, 2455, 2456, 2457, 2458, 2458, 2460, 2462, 2464, 2454, 2457, 2457, 2457, 2458, 2459, 2460, 2462, 2464, 2465, 
+};
+uint32_t colour_ref_transform = 0;
+uint32_t colour_grid_width = 10;
+uint32_t colour_grid_height = 8;
@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 3
+56, 47, 41, 38, 37, 37, 40, 44, 52, 66, 50, 42, 37, 35, 34, 34, 36, 40, 46, 57, 47, 40, 35, 33, 32, 33, 34, 38, 43, 53, 47, 39, 35, 33, 32, 32, 34, 37, 43, 52, 48, 40, 36, 34, 33, 33, 35, 38, 44, 54, 53, 44, 39, 36, 35, 36, 37, 41, 48, 60, 62, 50, 43, 40, 39, 40, 42, 47, 56, 73, //Gr - Ch 2
+57, 47, 41, 38, 37, 37, 39, 44, 52, 65, 50, 42, 37, 35, 34, 34, 36, 40, 46, 56, 47, 40, 35, 33, 32, 33, 34, 37, 43, 52, 46, 39, 35, 33, 32, 32, 34, 37, 43, 51, 48, 40, 36, 34, 33, 33, 35, 38, 44, 54, 53, 44, 39, 36, 35, 35, 37, 41, 48, 60, 62, 50, 43, 40, 39, 39, 42, 46, 55, 71, //Gb - Ch 1
+57, 47, 41, 38, 37, 37, 40, 44, 52, 66, 50, 42, 37, 35, 34, 34, 36, 40, 46, 57, 47, 40, 35, 33, 32, 33, 34, 38, 43, 53, 46, 39, 35, 33, 32, 32, 34, 37, 43, 52, 48, 40, 36, 34, 33, 33, 35, 38, 44, 54, 53, 44, 39, 36, 35, 35, 37, 41, 48, 60, 62, 50, 43, 40, 39, 39, 42, 47, 56, 71, //B - Ch 0
+58, 47, 41, 38, 37, 37, 40, 44, 52, 66, 51, 42, 37, 35, 34, 34, 36, 40, 46, 57, 47, 40, 35, 33, 32, 33, 34, 37, 43, 53, 47, 39, 35, 33, 32, 32, 34, 37, 43, 52, 48, 40, 36, 34, 33, 33, 35, 38, 44, 54, 53, 44, 39, 36, 35, 35, 37, 41, 48, 60, 62, 50, 43, 40, 39, 39, 42, 46, 56, 71, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 7;
@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 2
+58, 46, 40, 37, 36, 36, 39, 43, 51, 61, 51, 42, 37, 34, 33, 34, 35, 39, 46, 53, 48, 40, 35, 33, 32, 32, 34, 37, 44, 50, 48, 40, 35, 33, 32, 32, 34, 37, 44, 50, 51, 42, 37, 34, 33, 34, 35, 39, 46, 54, 58, 46, 40, 37, 36, 37, 39, 43, 51, 61, //Gr - Ch 3
+57, 46, 40, 37, 36, 36, 39, 43, 51, 61, 51, 42, 37, 34, 33, 34, 35, 39, 46, 54, 48, 40, 35, 33, 32, 32, 34, 37, 44, 51, 48, 40, 35, 33, 32, 32, 34, 37, 44, 51, 51, 42, 37, 34, 33, 34, 35, 39, 46, 54, 57, 46, 40, 37, 36, 37, 39, 43, 52, 61, //Gb - Ch 0
+58, 46, 40, 37, 36, 36, 39, 43, 51, 61, 51, 42, 37, 34, 33, 34, 35, 39, 46, 54, 48, 40, 35, 33, 32, 32, 34, 37, 44, 51, 48, 40, 35, 33, 32, 32, 34, 37, 44, 51, 51, 42, 37, 34, 33, 34, 35, 39, 46, 54, 58, 46, 40, 37, 36, 36, 39, 43, 51, 61, //B - Ch 1
+58, 46, 40, 37, 36, 37, 39, 43, 51, 61, 51, 42, 37, 34, 33, 34, 35, 39, 46, 54, 48, 40, 35, 33, 32, 32, 34, 37, 44, 50, 48, 40, 35, 33, 32, 32, 34, 37, 44, 50, 51, 42, 37, 34, 33, 34, 35, 39, 46, 54, 58, 46, 40, 37, 36, 36, 39, 43, 51, 61, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 6;
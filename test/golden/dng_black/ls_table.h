@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 0
+59, 49, 43, 40, 38, 38, 40, 43, 48, 59, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 47, 40, 39, 34, 33, 33, 34, 36, 40, 47, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 46, 40, 36, 33, 32, 32, 33, 35, 39, 46, 49, 41, 37, 35, 34, 33, 35, 37, 41, 49, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 64, 52, 45, 42, 40, 40, 42, 45, 52, 64, //Gr - Ch 1
+59, 48, 43, 40, 38, 38, 40, 43, 48, 59, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 49, 41, 37, 35, 34, 33, 35, 37, 41, 49, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 64, 52, 45, 42, 40, 40, 42, 45, 52, 64, //Gb - Ch 2
+59, 48, 43, 39, 38, 38, 39, 42, 48, 58, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 46, 40, 36, 33, 32, 32, 33, 35, 39, 46, 49, 41, 37, 35, 34, 34, 35, 37, 41, 49, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 64, 52, 46, 42, 40, 40, 42, 45, 52, 64, //B - Ch 3
+52, 48, 43, 39, 38, 38, 39, 43, 48, 59, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 46, 39, 35, 33, 32, 32, 33, 36, 39, 46, 49, 41, 37, 35, 34, 34, 35, 37, 41, 49, 54, 45, 40, 37, 36, 36, 37, 40, 45, 55, 65, 52, 46, 42, 40, 40, 42, 46, 52, 64, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 8;
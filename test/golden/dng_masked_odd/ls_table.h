@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 3
+57, 48, 42, 39, 38, 38, 39, 42, 48, 58, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 45, 39, 35, 33, 32, 32, 33, 35, 39, 45, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 48, 41, 37, 35, 34, 34, 35, 37, 41, 48, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 63, 51, 45, 42, 40, 40, 42, 45, 51, 63, //Gr - Ch 2
+58, 48, 42, 39, 38, 38, 39, 42, 48, 58, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 46, 39, 35, 33, 32, 32, 33, 35, 39, 45, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 49, 41, 37, 35, 34, 33, 35, 37, 41, 48, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 63, 51, 45, 42, 40, 40, 42, 45, 51, 63, //Gb - Ch 1
+58, 48, 42, 39, 38, 38, 39, 42, 48, 58, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 45, 39, 35, 33, 32, 32, 33, 35, 39, 45, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 48, 41, 37, 35, 33, 33, 35, 37, 41, 48, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 63, 51, 45, 41, 40, 40, 42, 45, 51, 63, //B - Ch 0
+58, 48, 43, 39, 38, 38, 39, 42, 48, 58, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 47, 40, 37, 34, 33, 33, 34, 36, 40, 47, 46, 39, 35, 33, 32, 32, 33, 35, 39, 45, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 49, 41, 37, 35, 33, 33, 35, 37, 41, 48, 54, 45, 40, 37, 36, 36, 37, 40, 45, 53, 63, 51, 45, 42, 40, 40, 41, 45, 51, 62, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 8;
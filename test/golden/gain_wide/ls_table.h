@@ -0,0 +1,10 @@
+uint16_t ls_grid[] = {
+//R - Ch 0
+7480, 6163, 5443, 5048, 4869, 4866, 5040, 5432, 6142, 7406, 6514, 5521, 4931, 4593, 4438, 4433, 4578, 4901, 5477, 6485, 6004, 5233, 4702, 4371, 4209, 4191, 4316, 4612, 5133, 5995, 5825, 5058, 4558, 4254, 4108, 4096, 4217, 4496, 4988, 5803, 5903, 5031, 4532, 4253, 4127, 4128, 4255, 4531, 5020, 5861, 6228, 5255, 4716, 4420, 4287, 4289, 4426, 4726, 5257, 6182, 6882, 5785, 5147, 4784, 4615, 4606, 4761, 5114, 5748, 6845, 8121, 6592, 5781, 5343, 5148, 5146, 5338, 5769, 6565, 8041, //Gr - Ch 1
+7431, 6150, 5437, 5043, 4866, 4865, 5041, 5435, 6148, 7427, 6500, 5487, 4906, 4580, 4433, 4434, 4581, 4904, 5483, 6500, 6008, 5130, 4617, 4325, 4193, 4193, 4326, 4616, 5130, 6015, 5818, 4989, 4501, 4223, 4096, 4096, 4223, 4500, 4988, 5821, 5877, 5032, 4536, 4253, 4125, 4125, 4253, 4534, 5028, 5874, 6198, 5270, 4730, 4425, 4286, 4286, 4425, 4728, 5266, 6194, 6861, 5750, 5118, 4766, 4607, 4606, 4765, 5118, 5750, 6862, 8071, 6579, 5776, 5340, 5143, 5141, 5335, 5776, 6585, 8065, //Gb - Ch 2
+7432, 6155, 5438, 5040, 4860, 4857, 5030, 5419, 6124, 7389, 6511, 5491, 4909, 4582, 4433, 4429, 4573, 4896, 5470, 6467, 6029, 5140, 4622, 4328, 4193, 4191, 4321, 4610, 5119, 5988, 5841, 5003, 4509, 4227, 4098, 4096, 4221, 4497, 4981, 5803, 5899, 5047, 4546, 4260, 4129, 4127, 4254, 4534, 5026, 5863, 6226, 5287, 4742, 4434, 4293, 4291, 4427, 4729, 5266, 6192, 6903, 5774, 5135, 4778, 4616, 4613, 4770, 5120, 5750, 6865, 8120, 6628, 5805, 5355, 5156, 5155, 5351, 5789, 6589, 8059, //B - Ch 3
+6601, 6099, 5475, 5027, 4838, 4852, 5043, 5431, 6125, 7416, 6486, 5481, 4901, 4575, 4427, 4427, 4574, 4898, 5476, 6486, 6019, 5127, 4613, 4322, 4191, 4191, 4322, 4612, 5124, 6006, 5809, 4986, 4499, 4221, 4096, 4097, 4224, 4500, 4985, 5819, 5878, 5031, 4535, 4254, 4128, 4130, 4259, 4539, 5031, 5879, 6208, 5273, 4733, 4428, 4291, 4292, 4431, 4735, 5273, 6207, 6874, 5761, 5128, 4773, 4613, 4612, 4771, 5125, 5762, 6883, 8120, 6599, 5791, 5353, 5153, 5148, 5343, 5792, 6613, 8090, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 8;
+uint32_t gain_frac_bits = 12;
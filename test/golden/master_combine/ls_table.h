@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 0
+59, 48, 43, 40, 38, 38, 39, 43, 48, 58, 51, 43, 38, 36, 35, 35, 36, 38, 43, 50, 47, 40, 39, 34, 33, 33, 34, 36, 40, 47, 46, 39, 35, 33, 32, 32, 33, 35, 39, 45, 46, 40, 36, 33, 32, 32, 33, 35, 39, 46, 49, 41, 37, 35, 34, 33, 35, 37, 41, 48, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 63, 52, 45, 42, 40, 40, 42, 45, 51, 63, //Gr - Ch 1
+57, 47, 42, 39, 38, 37, 39, 42, 47, 57, 50, 42, 38, 35, 34, 34, 35, 38, 42, 50, 46, 39, 36, 33, 32, 32, 33, 36, 40, 46, 45, 38, 35, 33, 32, 32, 33, 35, 38, 45, 45, 39, 35, 33, 32, 32, 33, 35, 39, 45, 48, 41, 36, 34, 33, 33, 34, 36, 41, 48, 53, 44, 40, 37, 36, 36, 37, 40, 44, 53, 62, 51, 44, 41, 40, 40, 41, 44, 51, 63, //Gb - Ch 2
+57, 47, 42, 39, 37, 37, 39, 42, 47, 57, 50, 42, 38, 35, 34, 34, 35, 38, 42, 50, 46, 40, 36, 33, 32, 32, 33, 36, 39, 46, 45, 39, 35, 33, 32, 32, 33, 35, 38, 45, 45, 39, 35, 33, 32, 32, 33, 35, 39, 45, 48, 41, 37, 34, 33, 33, 34, 36, 40, 48, 53, 45, 40, 37, 36, 36, 37, 39, 44, 53, 62, 51, 45, 41, 40, 40, 41, 44, 51, 62, //B - Ch 3
+62, 48, 42, 39, 38, 38, 39, 43, 48, 58, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 45, 39, 35, 33, 32, 32, 33, 35, 39, 46, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 49, 41, 37, 35, 34, 34, 35, 37, 41, 48, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 64, 51, 45, 42, 40, 40, 42, 46, 52, 63, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 8;
@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 3
+54, 45, 40, 38, 37, 37, 39, 43, 50, 62, 48, 41, 37, 35, 34, 34, 36, 39, 45, 55, 46, 39, 35, 33, 32, 33, 34, 37, 42, 51, 45, 39, 35, 33, 32, 32, 34, 37, 42, 50, 47, 40, 36, 34, 33, 33, 35, 38, 43, 52, 51, 43, 38, 36, 35, 35, 37, 41, 47, 57, 58, 48, 42, 40, 38, 39, 41, 45, 53, 67, //Gr - Ch 2
+55, 46, 40, 38, 37, 37, 39, 43, 50, 62, 49, 41, 37, 35, 34, 34, 36, 39, 45, 54, 46, 39, 35, 33, 32, 33, 34, 37, 42, 51, 45, 39, 35, 33, 32, 32, 34, 37, 42, 50, 47, 40, 36, 34, 33, 33, 35, 38, 43, 52, 51, 43, 38, 36, 35, 35, 37, 41, 47, 57, 59, 49, 43, 40, 38, 39, 41, 45, 54, 67, //Gb - Ch 1
+55, 46, 40, 38, 37, 37, 39, 43, 51, 63, 49, 41, 37, 35, 34, 34, 36, 39, 45, 55, 46, 39, 35, 33, 32, 33, 34, 37, 43, 51, 45, 39, 35, 33, 32, 32, 34, 37, 42, 50, 47, 40, 36, 34, 33, 33, 35, 38, 43, 52, 51, 43, 38, 36, 35, 35, 37, 41, 47, 58, 59, 48, 43, 40, 38, 39, 41, 46, 54, 67, //B - Ch 0
+54, 45, 40, 38, 37, 37, 39, 43, 50, 61, 48, 41, 37, 35, 34, 34, 36, 39, 45, 53, 46, 39, 35, 33, 32, 33, 34, 37, 42, 50, 45, 39, 35, 33, 32, 32, 34, 37, 42, 49, 46, 40, 36, 34, 33, 33, 35, 38, 43, 51, 50, 43, 38, 36, 35, 35, 37, 40, 46, 56, 58, 48, 42, 39, 38, 39, 41, 45, 53, 65, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 7;
@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 3
+54, 45, 40, 38, 37, 37, 39, 43, 50, 58, 48, 41, 37, 35, 34, 34, 36, 39, 45, 52, 46, 39, 35, 33, 32, 33, 34, 37, 42, 48, 45, 39, 35, 33, 32, 32, 34, 37, 42, 48, 47, 40, 36, 34, 33, 33, 35, 38, 43, 50, 51, 43, 38, 36, 35, 35, 37, 41, 47, 54, 56, 47, 41, 39, 38, 38, 40, 44, 52, 61, //Gr - Ch 2
+55, 46, 40, 38, 37, 37, 39, 43, 50, 59, 49, 41, 37, 35, 34, 34, 36, 39, 45, 52, 46, 39, 35, 33, 32, 33, 34, 37, 43, 49, 46, 39, 35, 33, 32, 32, 34, 37, 42, 48, 47, 40, 36, 34, 33, 33, 35, 38, 43, 50, 51, 43, 38, 36, 35, 35, 37, 41, 47, 55, 57, 47, 42, 39, 38, 38, 40, 44, 52, 61, //Gb - Ch 1
+55, 46, 41, 38, 37, 37, 39, 43, 51, 59, 49, 41, 37, 35, 34, 34, 36, 39, 45, 52, 46, 39, 35, 33, 32, 33, 34, 37, 43, 49, 45, 39, 35, 33, 32, 32, 34, 37, 42, 48, 47, 40, 36, 34, 33, 33, 35, 38, 44, 50, 51, 43, 38, 36, 35, 35, 37, 41, 47, 55, 57, 47, 41, 39, 38, 38, 40, 44, 52, 62, //B - Ch 0
+54, 45, 40, 38, 37, 37, 39, 43, 50, 58, 48, 41, 37, 35, 34, 34, 36, 39, 45, 51, 46, 39, 35, 33, 32, 33, 34, 37, 42, 48, 45, 39, 35, 33, 32, 32, 34, 37, 42, 47, 46, 40, 36, 34, 33, 33, 35, 38, 43, 49, 51, 43, 38, 36, 35, 35, 37, 40, 46, 54, 56, 46, 41, 38, 37, 38, 40, 44, 51, 60, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 7;
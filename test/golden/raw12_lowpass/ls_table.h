@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 2
+57, 46, 40, 37, 36, 37, 39, 43, 52, 62, 50, 42, 37, 34, 33, 34, 36, 39, 46, 54, 48, 40, 35, 33, 32, 32, 34, 38, 44, 51, 48, 40, 35, 33, 32, 32, 34, 38, 44, 51, 51, 42, 37, 34, 33, 34, 36, 39, 47, 55, 57, 46, 40, 37, 36, 37, 39, 43, 52, 62, //Gr - Ch 3
+57, 46, 40, 37, 36, 37, 39, 43, 52, 62, 50, 41, 37, 34, 33, 34, 36, 39, 47, 55, 48, 40, 35, 33, 32, 32, 34, 38, 44, 52, 48, 40, 35, 33, 32, 32, 34, 38, 44, 52, 50, 42, 37, 34, 33, 34, 36, 40, 47, 55, 57, 46, 40, 37, 36, 37, 39, 43, 52, 63, //Gb - Ch 0
+57, 46, 40, 37, 36, 37, 39, 43, 52, 62, 51, 42, 37, 34, 33, 34, 36, 39, 46, 54, 48, 40, 35, 33, 32, 32, 34, 38, 44, 51, 48, 40, 35, 33, 32, 32, 34, 38, 44, 51, 51, 42, 37, 34, 33, 34, 36, 39, 46, 54, 57, 46, 40, 37, 36, 37, 39, 43, 52, 62, //B - Ch 1
+57, 46, 40, 37, 36, 37, 39, 44, 52, 63, 50, 41, 37, 34, 33, 34, 36, 39, 47, 55, 48, 40, 35, 33, 32, 32, 34, 38, 44, 51, 48, 40, 35, 33, 32, 32, 34, 38, 44, 52, 50, 41, 37, 34, 33, 34, 36, 39, 47, 55, 57, 46, 40, 37, 36, 37, 39, 43, 52, 62, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 6;
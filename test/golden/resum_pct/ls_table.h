@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 0
+57, 47, 41, 38, 36, 36, 37, 40, 44, 52, 50, 42, 37, 35, 33, 33, 34, 36, 40, 46, 46, 39, 35, 33, 32, 32, 32, 34, 37, 43, 45, 38, 34, 32, 32, 32, 32, 33, 36, 41, 45, 39, 35, 32, 32, 32, 32, 33, 37, 42, 48, 40, 36, 33, 32, 32, 33, 35, 38, 44, 53, 44, 39, 36, 35, 34, 35, 37, 41, 48, 59, 48, 42, 39, 37, 37, 38, 41, 45, 54, //Gr - Ch 1
+57, 47, 41, 38, 37, 36, 37, 40, 45, 53, 50, 42, 37, 35, 33, 33, 34, 36, 40, 47, 46, 39, 35, 33, 32, 32, 32, 34, 38, 44, 45, 38, 34, 32, 32, 32, 32, 33, 37, 42, 45, 38, 34, 32, 32, 32, 32, 34, 37, 43, 47, 40, 36, 33, 32, 32, 33, 35, 39, 45, 52, 44, 39, 36, 35, 35, 36, 38, 42, 49, 59, 48, 42, 39, 37, 37, 38, 41, 46, 55, //Gb - Ch 2
+57, 47, 41, 38, 37, 36, 37, 40, 45, 53, 50, 42, 37, 35, 33, 33, 34, 36, 40, 47, 46, 39, 35, 33, 32, 32, 32, 34, 38, 43, 45, 38, 34, 32, 32, 32, 32, 33, 37, 42, 45, 38, 35, 32, 32, 32, 32, 34, 37, 43, 48, 40, 36, 34, 32, 32, 33, 35, 39, 45, 53, 44, 39, 36, 35, 35, 35, 38, 42, 49, 59, 48, 42, 39, 38, 37, 38, 41, 46, 55, //B - Ch 3
+57, 47, 41, 38, 36, 36, 37, 39, 44, 51, 50, 42, 37, 35, 33, 33, 34, 36, 39, 45, 46, 39, 35, 33, 32, 32, 32, 34, 37, 42, 45, 38, 34, 32, 32, 32, 32, 33, 36, 41, 45, 39, 35, 32, 32, 32, 32, 33, 36, 42, 48, 40, 36, 34, 32, 32, 33, 35, 38, 44, 53, 44, 39, 36, 35, 34, 35, 37, 41, 48, 59, 48, 42, 39, 37, 37, 38, 41, 45, 53, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 8;
@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 1
+63, 52, 45, 42, 40, 40, 42, 45, 52, 63, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 48, 41, 37, 35, 34, 34, 35, 37, 41, 48, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 58, 48, 42, 39, 38, 38, 39, 42, 48, 58, //Gr - Ch 0
+63, 51, 45, 42, 40, 40, 42, 45, 52, 63, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 48, 41, 37, 35, 33, 33, 35, 37, 41, 49, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 45, 39, 35, 33, 32, 32, 33, 35, 39, 46, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 58, 48, 42, 39, 38, 38, 39, 42, 48, 58, //Gb - Ch 3
+63, 52, 45, 42, 40, 40, 42, 45, 52, 63, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 49, 41, 37, 35, 34, 34, 35, 37, 41, 49, 46, 39, 35, 33, 32, 32, 33, 35, 39, 46, 46, 39, 35, 33, 32, 32, 33, 35, 39, 45, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 58, 48, 42, 39, 38, 38, 39, 42, 48, 58, //B - Ch 2
+63, 52, 45, 42, 40, 40, 42, 45, 52, 64, 54, 45, 40, 37, 36, 36, 37, 40, 45, 54, 48, 41, 37, 35, 34, 34, 35, 37, 41, 49, 46, 39, 35, 33, 32, 32, 33, 36, 39, 46, 45, 39, 35, 33, 32, 32, 33, 35, 39, 46, 47, 40, 36, 34, 33, 33, 34, 36, 40, 47, 51, 43, 38, 36, 35, 35, 36, 38, 43, 51, 58, 48, 42, 39, 38, 38, 39, 42, 48, 58, };
+uint32_t ref_transform = 3;
+uint32_t grid_width = 10;
+uint32_t grid_height = 8;
@@ -0,0 +1,9 @@
+uint8_t ls_grid[] = {
+//R - Ch 3
+67, 53, 45, 41, 39, 39, 41, 45, 53, 70, 58, 46, 40, 37, 35, 35, 37, 40, 46, 58, 52, 42, 37, 34, 33, 33, 34, 37, 42, 52, 50, 41, 36, 33, 32, 32, 33, 36, 41, 50, 50, 41, 36, 33, 32, 32, 34, 36, 41, 50, 54, 44, 38, 35, 34, 34, 35, 38, 44, 54, 63, 49, 42, 39, 37, 37, 39, 42, 49, 63, 78, 59, 49, 44, 42, 42, 44, 49, 59, 79, //Gr - Ch 2
+70, 54, 45, 41, 39, 39, 41, 45, 53, 69, 58, 46, 40, 37, 35, 35, 37, 40, 46, 57, 52, 42, 37, 34, 33, 33, 34, 37, 42, 52, 50, 41, 36, 33, 32, 32, 33, 36, 41, 50, 51, 41, 36, 34, 32, 32, 33, 36, 41, 50, 54, 44, 38, 35, 34, 34, 35, 38, 44, 54, 63, 49, 42, 39, 37, 37, 39, 42, 49, 62, 79, 59, 49, 44, 42, 42, 44, 49, 58, 78, //Gb - Ch 1
+70, 54, 46, 41, 40, 40, 41, 46, 54, 70, 58, 46, 40, 37, 35, 35, 37, 40, 46, 58, 52, 42, 37, 34, 33, 33, 34, 37, 42, 52, 50, 41, 36, 33, 32, 32, 33, 36, 41, 50, 50, 41, 36, 34, 32, 32, 33, 36, 41, 50, 54, 44, 38, 35, 34, 34, 35, 38, 44, 54, 62, 49, 42, 39, 37, 37, 39, 42, 49, 62, 78, 58, 49, 44, 42, 42, 44, 49, 58, 78, //B - Ch 0
+70, 54, 46, 41, 40, 40, 41, 45, 53, 70, 58, 46, 40, 37, 35, 35, 37, 40, 46, 57, 52, 42, 38, 34, 33, 33, 34, 37, 42, 52, 50, 41, 36, 33, 32, 32, 33, 36, 41, 50, 51, 41, 36, 34, 32, 32, 33, 36, 41, 50, 54, 44, 38, 35, 34, 34, 35, 38, 44, 54, 63, 49, 42, 39, 37, 37, 39, 42, 49, 62, 79, 59, 49, 44, 42, 42, 44, 49, 58, 78, };
+uint32_t ref_transform = 0;
+uint32_t grid_width = 10;
+uint32_t grid_height = 8;
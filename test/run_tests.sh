@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# Regression tests for lens_shading_analyse.
+#
+# Generates a synthetic raw for each case in cases.txt, runs the analysis on
+# it and compares the lens shading tables bit for bit with the golden outputs.
+# A case may list the output files to compare, instead of the tables, after a
+# fourth '|'.
+# A case that expects the analysis to fail gives its exit status after a
+# fifth '|'. It passes if the tool exits with that status and writes none of
+# the output files, and has no golden outputs.
+# Instead of gen_raw arguments, '< case/file' reads an output of an earlier case.
+# Further inputs, such as a dark frame, follow the gen_raw arguments as
+# '; file gen_raw arguments'.
+# Run with --update to regenerate the golden outputs after an intentional
+# change to the results.
+
+test_dir=$(cd "$(dirname "$0")" && pwd)
+tool="$test_dir/../lens_shading_analyse"
+gen="$test_dir/gen_raw"
+golden_dir="$test_dir/golden"
+outputs="ls_table.h ls.bin"
+update=0
+passed=0
+failed=0
+
+if [ "$1" = "--update" ]; then
+	update=1
+fi
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "$work_dir"' EXIT
+
+while IFS='|' read -r name gen_args args extra; do
+	name=$(echo $name)
+	case "$name" in
+	""|\#*)
+		continue
+		;;
+	esac
+
+	status=0
+	case "$extra" in
+	*\|*)
+		status=$(echo ${extra#*|})
+		extra=${extra%%|*}
+		;;
+	esac
+	extra=$(echo $extra)
+	case_outputs=${extra:-$outputs}
+	case_dir="$work_dir/$name"
+	mkdir -p "$case_dir"
+	case "$gen_args" in
+	*\<*)
+		# Input taken from the outputs of an earlier case, along with
+		# the files next to it. in.raw is a link to the copy, so the tool
+		# can tell when it would write over its input.
+		src=$(echo ${gen_args#*<})
+		cp "$work_dir/${src%%/*}"/* "$case_dir/" 2> /dev/null
+		if ! ln -f "$case_dir/${src#*/}" "$case_dir/in.raw"; then
+			echo "FAIL $name: no $src"
+			failed=$((failed+1))
+			continue
+		fi
+		;;
+	*)
+		inputs="in.raw ${gen_args%%;*}"
+		rest="$gen_args"
+		gen_ok=1
+		while [ -n "$inputs" ]; do
+			set -- $inputs
+			file=$1
+			shift
+			if ! "$gen" -o "$case_dir/$file" "$@" > /dev/null; then
+				echo "FAIL $name: gen_raw $*"
+				gen_ok=0
+				break
+			fi
+			case "$rest" in
+			*\;*)
+				rest=${rest#*;}
+				inputs=${rest%%;*}
+				;;
+			*)
+				inputs=""
+				;;
+			esac
+		done
+		if [ $gen_ok = 0 ]; then
+			failed=$((failed+1))
+			continue
+		fi
+		;;
+	esac
+	if [ $status != 0 ]; then
+		# Not left over from the case the input came from
+		(cd "$case_dir" && rm -f $case_outputs)
+	fi
+	(cd "$case_dir" && "$tool" -i in.raw -o 3 $args > log.txt)
+	exit_status=$?
+	if [ $exit_status != $status ]; then
+		echo "FAIL $name: lens_shading_analyse $args exited with $exit_status"
+		failed=$((failed+1))
+		continue
+	fi
+	if [ $status != 0 ]; then
+		result=PASS
+		for f in $case_outputs; do
+			if [ -e "$case_dir/$f" ]; then
+				result=FAIL
+				echo "FAIL $name: $f written"
+			fi
+		done
+		if [ $result = PASS ]; then
+			passed=$((passed+1))
+		else
+			failed=$((failed+1))
+		fi
+		continue
+	fi
+
+	if [ $update = 1 ]; then
+		mkdir -p "$golden_dir/$name"
+		for f in $case_outputs; do
+			cp "$case_dir/$f" "$golden_dir/$name/$f"
+		done
+		echo "UPDATED $name"
+		continue
+	fi
+
+	result=PASS
+	for f in $case_outputs; do
+		if ! cmp -s "$case_dir/$f" "$golden_dir/$name/$f"; then
+			result=FAIL
+			echo "FAIL $name: $f differs from golden"
+		fi
+	done
+	if [ $result = PASS ]; then
+		passed=$((passed+1))
+	else
+		failed=$((failed+1))
+	fi
+done < "$test_dir/cases.txt"
+
+if [ $update = 0 ]; then
+	echo "$passed passed, $failed failed"
+fi
+[ $failed = 0 ]